@@ -0,0 +1,299 @@
+/*
+Load generator and benchmark for the GPIO LCD driver. A number of writer
+threads, each on its own open file, keep updating the panel through
+write(), LCD_IOC_BATCH or the mmap()ed framebuffer, and the tool reports
+what each update cost in the system call, how long it took to reach the
+LCD (with -s, from LCD_IOC_SYNC), and how many updates the driver folded
+together instead of sending as frames of their own.
+
+    make lcd-bench
+    ./lcd-bench -m batch -w 4 -n 500 -p cell -s
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/types.h>
+
+#include "lcd-mod.h"
+
+#define LCD_DDRAM 0x80
+#define MAX_CELLS 80
+#define MAX_WRITERS 16
+
+enum mode { MODE_WRITE, MODE_BATCH, MODE_MMAP };
+enum pattern { PAT_FULL, PAT_CELL, PAT_COUNTER };
+
+static const char *dev = "/dev/lcd";
+static enum mode mode = MODE_WRITE;
+static enum pattern pattern = PAT_FULL;
+static unsigned int writers = 1, updates = 200;
+static int sync_each;
+static struct lcd_geometry geo;
+
+struct writer {
+    pthread_t thread;
+    unsigned int id;
+    int fd;
+    char *fb;                       // mapping, in mmap mode
+    uint64_t *call_ns;              // time in the system call
+    uint64_t *glass_ns;             // until LCD_IOC_SYNC returned
+    int err;
+};
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* DDRAM address of a cell, for the batch mode's own addressing. As in the
+driver, rows 3 and 4 carry on from the ends of rows 1 and 2. */
+static unsigned int cell_addr(unsigned int row, unsigned int col){
+    return (row & 1) * 0x40 + (row >> 1) * geo.cols + col;
+}
+
+/* Lay out update k of writer w as the text of the cells it changes,
+starting at cell *first. */
+static unsigned int fill(struct writer *w, unsigned int k, char *text, unsigned int *first){
+    unsigned int n = geo.rows * geo.cols, i;
+
+    switch (pattern) {
+    case PAT_FULL:
+        for (i = 0; i < n; i++)
+            text[i] = '0' + (k + i + w->id) % 10;
+        *first = 0;
+        return n;
+    case PAT_CELL:
+        text[0] = '0' + k % 10;
+        *first = (w->id * 7 + k) % n;
+        return 1;
+    case PAT_COUNTER:
+    default:
+        *first = (w->id % geo.rows) * geo.cols;
+        i = snprintf(text, MAX_CELLS, "%*u", geo.cols < 8 ? geo.cols : 8, k);
+        return i < geo.cols ? i : geo.cols;
+    }
+}
+
+/* write() lays text out at the file's own cursor rather than at first:
+a full update starts from a cleared, homed cursor, a counter from the start
+of the cursor's row, and a single cell goes wherever the cursor has got to. */
+static int update_write(struct writer *w, const char *text, unsigned int len){
+    char buf[MAX_CELLS + 1];
+    unsigned int n = 0;
+
+    if (pattern == PAT_FULL)
+        buf[n++] = '\f';
+    else if (pattern == PAT_COUNTER)
+        buf[n++] = '\r';
+    memcpy(buf + n, text, len);
+    n += len;
+    return write(w->fd, buf, n) == (ssize_t)n ? 0 : -1;
+}
+
+static int update_batch(struct writer *w, const char *text, unsigned int first, unsigned int len){
+    struct lcd_op ops[MAX_CELLS + 4];
+    struct lcd_batch batch = { .flags = 0 };
+    unsigned int n = 0, i, cell, row = -1;
+
+    for (i = 0; i < len; i++) {
+        cell = first + i;
+        if (cell / geo.cols != row) {
+            row = cell / geo.cols;
+            ops[n].rs = 0;
+            ops[n++].val = LCD_DDRAM | cell_addr(row, cell % geo.cols);
+        }
+        ops[n].rs = 1;
+        ops[n++].val = text[i];
+    }
+    batch.ops = (unsigned long)ops;
+    batch.count = n;
+    return ioctl(w->fd, LCD_IOC_BATCH, &batch);
+}
+
+static int update_mmap(struct writer *w, const char *text, unsigned int first, unsigned int len){
+    memcpy(w->fb + first, text, len);
+    return 0;
+}
+
+static void *run_writer(void *arg){
+    struct writer *w = arg;
+    char text[MAX_CELLS];
+    unsigned int k, first, len;
+    uint64_t start, t;
+    int ret;
+
+    for (k = 0; k < updates; k++) {
+        len = fill(w, k, text, &first);
+        start = now_ns();
+        if (mode == MODE_WRITE)
+            ret = update_write(w, text, len);
+        else if (mode == MODE_BATCH)
+            ret = update_batch(w, text, first, len);
+        else
+            ret = update_mmap(w, text, first, len);
+        t = now_ns();
+        if (ret < 0) {
+            w->err = errno;
+            return NULL;
+        }
+        w->call_ns[k] = t - start;
+        if (sync_each) {
+            if (ioctl(w->fd, LCD_IOC_SYNC) < 0) {
+                w->err = errno;
+                return NULL;
+            }
+            w->glass_ns[k] = now_ns() - start;
+        }
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, uint64_t *ns, size_t n){
+    qsort(ns, n, sizeof(*ns), cmp_u64);
+    printf("%-8s p50 %8.1fus  p99 %8.1fus  max %8.1fus\n", what,
+           ns[n / 2] / 1e3, ns[n * 99 / 100] / 1e3, ns[n - 1] / 1e3);
+}
+
+static void usage(const char *prog){
+    fprintf(stderr,
+            "usage: %s [-d dev] [-m write|batch|mmap] [-p full|cell|counter]\n"
+            "          [-w writers] [-n updates] [-s]\n"
+            "  -s  wait for every update to reach the LCD (LCD_IOC_SYNC)\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv){
+    struct writer w[MAX_WRITERS];
+    struct lcd_stats_info before, after;
+    uint64_t *call, *glass, start, elapsed;
+    size_t total;
+    unsigned int i;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "d:m:p:w:n:s")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev = optarg;
+            break;
+        case 'm':
+            if (!strcmp(optarg, "write"))
+                mode = MODE_WRITE;
+            else if (!strcmp(optarg, "batch"))
+                mode = MODE_BATCH;
+            else if (!strcmp(optarg, "mmap"))
+                mode = MODE_MMAP;
+            else
+                usage(argv[0]);
+            break;
+        case 'p':
+            if (!strcmp(optarg, "full"))
+                pattern = PAT_FULL;
+            else if (!strcmp(optarg, "cell"))
+                pattern = PAT_CELL;
+            else if (!strcmp(optarg, "counter"))
+                pattern = PAT_COUNTER;
+            else
+                usage(argv[0]);
+            break;
+        case 'w':
+            writers = atoi(optarg);
+            break;
+        case 'n':
+            updates = atoi(optarg);
+            break;
+        case 's':
+            sync_each = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!writers || writers > MAX_WRITERS || !updates)
+        usage(argv[0]);
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0 || ioctl(fd, LCD_IOC_GET_GEOMETRY, &geo) < 0) {
+        perror(dev);
+        return 1;
+    }
+    if (!geo.rows || geo.rows * geo.cols > MAX_CELLS) {
+        fprintf(stderr, "%s: unexpected geometry %ux%u\n", dev, geo.rows, geo.cols);
+        return 1;
+    }
+
+    total = (size_t)writers * updates;
+    call = calloc(total, sizeof(*call));
+    glass = calloc(total, sizeof(*glass));
+    if (!call || !glass) {
+        perror("calloc");
+        return 1;
+    }
+    for (i = 0; i < writers; i++) {
+        memset(&w[i], 0, sizeof(w[i]));
+        w[i].id = i;
+        w[i].call_ns = call + (size_t)i * updates;
+        w[i].glass_ns = glass + (size_t)i * updates;
+        w[i].fd = open(dev, O_RDWR);
+        if (w[i].fd < 0) {
+            perror(dev);
+            return 1;
+        }
+        if (mode == MODE_MMAP) {
+            w[i].fb = mmap(NULL, geo.rows * geo.cols, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, w[i].fd, 0);
+            if (w[i].fb == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+            }
+        }
+    }
+
+    if (ioctl(fd, LCD_IOC_GET_STATS, &before) < 0) {
+        perror("LCD_IOC_GET_STATS");
+        return 1;
+    }
+    start = now_ns();
+    for (i = 0; i < writers; i++)
+        pthread_create(&w[i].thread, NULL, run_writer, &w[i]);
+    for (i = 0; i < writers; i++)
+        pthread_join(w[i].thread, NULL);
+    // count the tail end as well: everything written has to reach the LCD
+    ioctl(fd, LCD_IOC_SYNC);
+    elapsed = now_ns() - start;
+    ioctl(fd, LCD_IOC_GET_STATS, &after);
+
+    for (i = 0; i < writers; i++) {
+        if (w[i].err) {
+            fprintf(stderr, "writer %u: %s\n", i, strerror(w[i].err));
+            return 1;
+        }
+    }
+
+    printf("%u writers x %u updates in %.3fs: %.0f updates/s\n", writers, updates,
+           elapsed / 1e9, total * 1e9 / elapsed);
+    report("syscall", call, total);
+    if (sync_each)
+        report("on-glass", glass, total);
+    printf("bytes %llu  frames %llu  coalesced %llu  cells skipped %llu\n",
+           (unsigned long long)(after.bytes - before.bytes),
+           (unsigned long long)(after.frames - before.frames),
+           (unsigned long long)(after.coalesced - before.coalesced),
+           (unsigned long long)(after.skipped - before.skipped));
+    return 0;
+}
@@ -16,82 +16,1049 @@
 #include <linux/sched.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/i2c.h>
+#include <linux/of.h>
+#include <linux/of_gpio.h>
+#include <linux/idr.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/pm_runtime.h>
 #include <asm/gpio.h>
 
+#include "lcd-mod.h"
+
+#define CREATE_TRACE_POINTS
+#include "lcd-trace.h"
+
 /*
 This code will create a platform device for an attached 16x2 LCD display
 through the Raspberry Pi's GPIO pins. It will create a character device 
 that can be called via open() and written to. Programs that write to the
 device driver will see the output written to the LCD.
+
+Every panel is a platform device of its own with its own minor, /dev/lcd
+for the first and /dev/lcdN after it. The panel described by the module
+parameters is created by the module itself; more come from the device
+tree.
 */
 
 #define SYSTIMER_MOD_AUTH "Tony Provencal"
 #define SYSTIMER_MOD_DESCR "GPIO LCD Driver"
 #define SYSTIMER_MOD_SDEV "GPIO LCD RPi"
 
+struct lcd_data;
+
 static long lcd_ioctl(struct file * flip, unsigned int cmd, unsigned long arg);
+static ssize_t lcd_file_write(struct file *filp, const char __user *buf,
+                              size_t count, loff_t *f_pos);
+static int lcd_mmap(struct file *filp, struct vm_area_struct *vma);
+static unsigned int lcd_poll(struct file *filp, poll_table *wait);
 static int lcd_open(struct inode *inode, struct file *filp);
 static int lcd_release(struct inode *inode, struct file *filp);
 static char *lcd_devnode(struct device *dev, umode_t *mode);
-static int lcd_init(void);
-static int req_gpio(void);
-static int lcd_write(const uint8_t data[]);
-
-
-
-/* What follows is a list of defined values to be used in lcd_write() calls.
-As this code uses the 4-bit bus mode on the LCD, the data to be sent over
-the GPIO pins is split up into 4-bit "nibbles" and sent one at a time. As
-the gpio pins in use are not sequential, representing the instructions and
-data as arrays of 0s and 1s is convenient. */
-static const uint8_t reset[] 	   = {0,0,0,0,0,0,0,0};
-static const uint8_t clear[]	   = {0,0,0,0,0,0,0,1};
-static const uint8_t home[] 	   = {0,0,0,0,0,0,1,0};
-static const uint8_t entry[]	   = {0,0,0,0,0,1,1,0};
-static const uint8_t displayon[]   = {0,0,0,0,1,1,1,1};
-static const uint8_t displayoff[]  = {0,0,0,0,1,0,0,0};
-static const uint8_t functionset[] = {0,0,1,0,0,0,0,0};
-static const uint8_t startup1[]    = {0,0,1,1,0,0,1,1};
-static const uint8_t startup2[]	   = {0,0,1,1,0,0,1,0};
-static const uint8_t a[]     	   = {0,1,0,1,0,0,0,1};
+static int lcd_init(struct lcd_data *lcd);
+static int req_gpio(struct lcd_data *lcd);
+static int req_i2c(struct lcd_data *lcd);
+static int lcd_write(struct lcd_data *lcd, uint8_t byte, int rs);
+static void lcd_wait_ready(struct lcd_data *lcd, unsigned int exec_us);
+static void lcd_pause(struct lcd_data *lcd, unsigned int us);
+static void lcd_flush(struct lcd_data *lcd);
+static int lcd_ac_next(struct lcd_data *lcd, int ac);
+static int lcd_addr_cell(struct lcd_data *lcd, int addr);
+static void lcd_forget_glyphs(struct lcd_data *lcd);
+static void lcd_track(struct lcd_data *lcd, uint8_t val, int rs);
+static void lcd_run_cmds(struct lcd_data *lcd);
+static void lcd_work(struct work_struct *work);
+static void lcd_flush_work(struct work_struct *work);
+static void lcd_refresh(struct work_struct *work);
+static void lcd_marquee_work(struct work_struct *work);
+static void lcd_vc_work(struct work_struct *work);
+static void lcd_sleep_work(struct work_struct *work);
+
+/* Geometry of the attached display. Characters written to the device land
+in a shadow framebuffer of this size, and only the cells that differ from
+what the LCD is currently showing are sent over the bus. The HD44780 has
+80 bytes of display RAM, which bounds the largest panel (20x4, 40x2). */
+#define LCD_MAX_ROWS 4
+#define LCD_MAX_CELLS 80
+
+static int rows = 2;
+module_param(rows, int, S_IRUGO);
+MODULE_PARM_DESC(rows, "Number of LCD rows (1, 2 or 4)");
+static int cols = 16;
+module_param(cols, int, S_IRUGO);
+MODULE_PARM_DESC(cols, "Number of LCD columns");
+
+/* While the framebuffer is mmap()ed, the transmit engine is kicked this
+often to pick up whatever userspace has stored into it. */
+static unsigned int refresh_ms = 50;
+module_param(refresh_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(refresh_ms, "Flush interval in ms while the framebuffer is mapped");
+
+/* The liquid crystal cannot visibly settle much faster than 20-30Hz, so
+framebuffer changes are flushed at most this many times a second and
+everything written within one frame goes out in a single flush. */
+#define LCD_MAX_FPS_LIMIT 1000
+static unsigned int max_fps = 25;
+module_param(max_fps, uint, S_IRUGO);
+MODULE_PARM_DESC(max_fps, "Maximum framebuffer flushes per second (0 = unlimited)");
+
+/* Show each virtual console that has an open file on it in turn, for this
+long each. Without it the console shown only changes on LCD_IOC_SHOW_VC. */
+static unsigned int vc_rotate_ms = 0;
+module_param(vc_rotate_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(vc_rotate_ms, "Rotate between the virtual consoles in use every this many ms (0 = off)");
+
+/* Turn a panel's display off and park its transport once the engine has
+had nothing to send for this long, through runtime PM autosuspend; the
+delay can be changed later in the platform device's power/ directory.
+The next thing sent turns the display back on with one instruction,
+since the controller keeps its display RAM when the display is off. */
+static unsigned int idle_ms = 0;
+module_param(idle_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(idle_ms, "Turn the display off after this many ms without updates (0 = never)");
+
+/* Timing of one controller variant, from its datasheet: how long clear
+and return home take, how long every other instruction and character
+write takes, and how long E has to stay high and then low again for each
+strobe. When the busy flag is polled, giving up after LCD_BF_TIMEOUT
+times the execution time means RW or DB7 is not wired and fixed delays
+are used instead. */
+struct lcd_timing {
+    const char *name;
+    unsigned int exec_us;
+    unsigned int slow_us;           // clear and return home
+    unsigned int e_high_ns;         // enable pulse width
+    unsigned int e_low_ns;          // rest of the enable cycle
+};
+
+/* "fast" is for clones whose oscillator runs at about twice the HD44780's
+270kHz; run the debugfs benchmark on a panel before settling on it. The
+WS0010 OLED controller takes 6.2ms to clear but only microseconds for
+anything else. */
+static const struct lcd_timing lcd_timings[] = {
+    { "hd44780", 37, 1520, 450, 550 },
+    { "ks0066",  39, 1530, 460, 540 },
+    { "st7066",  37, 1520, 460, 740 },
+    { "fast",    20,  820, 450, 550 },
+    { "ws0010",  10, 6200, 250, 250 },
+};
+
+#define LCD_BF_TIMEOUT 10
+
+/* Timing profile of the panels that do not name one in the device tree.
+It can be changed for each panel later through its "timing" attribute in
+sysfs. */
+static char *timing = "hd44780";
+module_param(timing, charp, S_IRUGO);
+MODULE_PARM_DESC(timing, "LCD controller timing: hd44780, ks0066, st7066, fast or ws0010");
+
+/* Poll the busy flag over RW instead of sleeping through the datasheet
+execution times. While RW is high the LCD drives the data lines at its
+own supply voltage, so a panel powered from 5V needs level shifting on those
+lines before this is turned on. */
+static bool busy_poll = 0;
+module_param(busy_poll, bool, S_IRUGO);
+MODULE_PARM_DESC(busy_poll, "Poll the LCD busy flag over RW (needs 3.3V-safe data lines)");
+
+/* A controller that is still powered from before, say across a module
+reload, is already in the right bus mode and only needs its entry and
+display modes reapplied, which saves the 85ms startup sequence. With 1 the
+driver checks by setting the address counter and reading it back over RW,
+so the same level shifting as for busy_poll is needed; 2 takes it on
+trust, for panels whose power is known to stay on. */
+static int warm_start = 0;
+module_param(warm_start, int, S_IRUGO);
+MODULE_PARM_DESC(warm_start, "Skip the LCD startup sequence: 0 = never, 1 = if the LCD reads back (4-bit bus only), 2 = always");
+
+/* In 8-bit mode DB0-DB3 are wired as well and every byte costs one enable
+strobe instead of two. */
+static int bus_width = 4;
+module_param(bus_width, int, S_IRUGO);
+MODULE_PARM_DESC(bus_width, "LCD data bus width, 4 or 8");
+
+/* GPIO pins of the panel created from the module parameters. Panels from
+the device tree name their own pins. DB0-DB3 are only used in 8-bit mode. */
+#define LCD_GPIO_RS 4
+#define LCD_GPIO_RW 17
+#define LCD_GPIO_E  18
+static const unsigned int db_gpio[8] = {5, 6, 12, 13, 22, 23, 24, 25};
+static const char * const db_label[8] = {
+    "DB0", "DB1", "DB2", "DB3", "DB4", "DB5", "DB6", "DB7",
+};
+
+/* Create the panel described by the module parameters. Turn this off when
+every panel comes from the device tree. */
+static bool param_device = 1;
+module_param(param_device, bool, S_IRUGO);
+MODULE_PARM_DESC(param_device, "Create /dev/lcd from the module parameters");
+
+// Number of minors reserved for panels
+#define LCD_MAX_DEVS 8
+
+/* More panels on the data lines and RS of the parameter panel, each with
+an E line of its own; they appear as /dev/lcd1 and up. */
+static unsigned int extra_e[LCD_MAX_DEVS - 1];
+static int n_extra_e;
+module_param_array(extra_e, uint, &n_extra_e, S_IRUGO);
+MODULE_PARM_DESC(extra_e, "E pins of more panels sharing the data lines of /dev/lcd");
+
+/* BCM2835 GPIO registers, as offsets from GPIO_BASE. Writing a 1 to a bit
+of GPSET0/GPCLR0 drives that pin high/low and leaves the others alone, so
+a whole nibble plus RS can be put on the bus with one write of each. */
+#define GPSET0 0x1c
+#define GPCLR0 0x28
+#define GPLEV0 0x34
+
+static bool fast_gpio = 1;
+module_param(fast_gpio, bool, S_IRUGO);
+MODULE_PARM_DESC(fast_gpio, "Drive the LCD through the GPIO registers instead of gpiolib");
+
+/* LCDs behind a PCF8574 I2C backpack are used by setting i2c_bus. The
+expander's eight outputs drive the LCD as below, with the data bus in
+4-bit mode, and every byte written to it sets all eight at once. */
+#define PCF_RS  BIT(0)
+#define PCF_RW  BIT(1)
+#define PCF_E   BIT(2)
+#define PCF_BL  BIT(3)  // backlight
+// P4-P7 drive DB4-DB7
+
+static int i2c_bus = -1;
+module_param(i2c_bus, int, S_IRUGO);
+MODULE_PARM_DESC(i2c_bus, "I2C bus of a PCF8574 backpack (-1 = LCD wired to GPIO)");
+static unsigned short i2c_addr = 0x27;
+module_param(i2c_addr, ushort, S_IRUGO);
+MODULE_PARM_DESC(i2c_addr, "I2C address of the PCF8574 backpack");
+static unsigned int i2c_khz = 100;
+module_param(i2c_khz, uint, S_IRUGO);
+MODULE_PARM_DESC(i2c_khz, "I2C bus clock in kHz, used to time the LCD over the bus");
+
+/* Expander bytes are collected in a buffer of this size and written in one
+I2C transfer, which holds a little over a full 16x2 redraw. */
+#define LCD_I2C_BUF 160
+
+/* GPSET0/GPCLR0 masks for one nibble value on DB7-DB4 or, in 8-bit mode,
+DB3-DB0. Every panel gets a table of all 16 values, built at probe from
+its pins. */
+struct lcd_nib_mask {
+    u32 set;
+    u32 clr;
+};
+
+/* How one panel is wired. The module parameters fill one in for the
+panel they describe, the device tree for the others. */
+struct lcd_platform_data {
+    int rows, cols;
+    int bus_width;
+    int i2c_bus;                    // PCF8574 backpack bus, or -1 for GPIO
+    unsigned short i2c_addr;
+    unsigned int gpio_rs, gpio_rw, gpio_e;
+    unsigned int gpio_db[8];        // DB0-DB7
+    const char *timing;             // profile name, NULL for the parameter
+};
+
+/* What follows is a list of instructions to be used in lcd_write() calls.
+On a 4-bit bus each byte is split up into 4-bit "nibbles" and sent one at
+a time, upper nibble first; with bus_width=8 it goes out whole, one strobe
+for all of DB7-DB0. Either way the masks lcd_build_masks() makes for each
+panel at probe map the values onto its non-sequential GPIO pins. */
+#define LCD_RESET       0x00
+#define LCD_CLEAR       0x01
+#define LCD_HOME        0x02
+#define LCD_ENTRY       0x06    // increment, no display shift
+#define LCD_DISPLAYON   0x0f    // display, cursor and blink on
+#define LCD_DISPLAYOFF  0x08
+#define LCD_FUNCTIONSET 0x28    // 4-bit bus, 2 lines, 5x8 font
+#define LCD_FS_8BIT     0x10    // function set: 8-bit bus
+#define LCD_FS_2LINE    0x08    // function set: 2 lines
+#define LCD_STARTUP1    0x33
+#define LCD_STARTUP2    0x32
+#define LCD_STARTUP8    0x30
+#define LCD_DDRAM       0x80    // Set DDRAM Address, OR in the address
+#define LCD_CGRAM       0x40    // Set CGRAM Address, OR in the address
+#define LCD_SHIFT_LEFT  0x18    // shift the display one column left
+
+/* Address counter values that are not a DDRAM address: unknown, or
+pointing into CGRAM after a Set CGRAM Address. */
+#define LCD_AC_UNKNOWN  -1
+#define LCD_AC_CGRAM    -2
+
+/* Instructions and characters queued by LCD_IOC_BATCH wait in a kfifo of
+this many entries (a power of two) for the transmit engine, which takes
+them out LCD_CMD_CHUNK at a time. */
+#define LCD_CMDQ_LEN 2048
+#define LCD_CMD_CHUNK 64
+
+/* Set in the rs of the last op of every batch on cmdq, so the engine knows
+where one batch ends and an urgent one may go in. */
+#define LCD_OP_END 0x80
+
+/* Each op in a flush plan is tagged with what it updates, so a flush cut
+short by an urgent batch knows what is left to send: a framebuffer cell,
+a CGRAM slot, or neither. */
+#define LCD_TAG_NONE    -1
+#define LCD_TAG_SLOT(s) (-2 - (s))
+
+/* Shortest marquee step. Display RAM lines are 40 characters long in
+two-line mode, which is where the display shift wraps around. */
+#define LCD_MARQUEE_MIN_MS 20
+#define LCD_LINE_LEN 40
+
+/* Busy-flag waits are counted in LCD_BF_BUCKETS buckets: under 10us,
+then doubling up to 1280us and over. */
+#define LCD_BF_BUCKETS 9
+
+/* Transmit path counters, shown in debugfs. The engine keeps all of them
+but hwm, which producers move on under qlock, and coalesced, which may be
+bumped from anywhere. */
+struct lcd_stats {
+    u64 bytes;                      // instructions and characters sent
+    u64 frames;                     // flushes sent whole
+    u64 skipped;                    // cells flushes found unchanged
+    u64 wait_ns;                    // time lcd_write() spent waiting
+    u64 bf_wait[LCD_BF_BUCKETS];    // busy-flag waits by length
+    u32 hwm;                        // most ops ever waiting in cmdq
+    atomic_t coalesced;             // changes folded into a pending flush
+};
+
+/* Self-benchmark, started from debugfs. Every test is repeated runs times
+(LCD_BENCH_RUNS unless given) under each transport and delay strategy the
+panel can use. */
+#define LCD_BENCH_RUNS 32
+#define LCD_BENCH_MAX 1000
+
+enum {
+    LCD_BENCH_REDRAW,               // every cell, a row address per row
+    LCD_BENCH_CELL,                 // one cell and its address
+    LCD_BENCH_CGRAM,                // one custom character
+    LCD_BENCH_CLEAR,
+    LCD_BENCH_TESTS
+};
+
+static const char *const lcd_bench_names[LCD_BENCH_TESTS] = {
+    "redraw", "cell", "cgram", "clear"
+};
+
+struct lcd_bench_result {
+    const char *bus;                // transport name
+    bool bf;                        // busy flag polled, not fixed delays
+    unsigned int test;              // LCD_BENCH_*
+    u64 rate;                       // bytes on the bus per second
+    u64 char_rate;                  // of those, characters (rs=1) per second
+    u32 p50, p99;                   // ns per run
+};
+
+struct lcd_bench {
+    struct work_struct work;        // runs on the panel's engine
+    struct lcd_data *lcd;
+    unsigned int runs;
+    int err;
+    unsigned int n;
+    struct lcd_bench_result res[2 * 2 * LCD_BENCH_TESTS];
+    u32 ns[LCD_BENCH_MAX];          // time of each run of one test
+};
+
+/* Custom characters live in eight CGRAM slots of eight rows each, which
+the LCD shows for character codes 0-7. */
+#define LCD_CGRAM_SLOTS 8
+
+// A glyph registered with LCD_IOC_SET_GLYPH
+struct lcd_glyph_def {
+    u8 rows[8];
+    unsigned int gen;               // bumped on every change, 0 if unset
+};
+
+// What one CGRAM slot holds
+struct lcd_glyph_slot {
+    int id;                         // glyph, or -1 for none
+    unsigned int gen;               // of the glyph when it was uploaded
+    unsigned long used;             // last flush that showed it
+};
+
+/* Longest flush: return home, entry mode, an address and eight rows for
+every CGRAM slot, and an address and a character for every cell. */
+#define LCD_PLAN_MAX (2 + 9 * LCD_CGRAM_SLOTS + 2 * LCD_MAX_CELLS)
 
 static const struct file_operations lcd_fops = {
     .owner=THIS_MODULE,
     .open=lcd_open,
     .release=lcd_release,
+    .write=lcd_file_write,
+    .mmap=lcd_mmap,
+    .poll=lcd_poll,
     .unlocked_ioctl=lcd_ioctl,
 };
 
+/* A transport moves bytes between the core and the LCD: the GPIO pins
+through gpiolib, the same pins through the GPIO registers, or a PCF8574
+I2C backpack. Only the transmit engine calls these.
+
+send_nibble clocks in a single nibble for the 4-bit startup sequence and
+send_byte a whole instruction or character; neither waits for the LCD.
+read_mode and read_busy read the busy flag, and are NULL when it cannot be
+read; read_addr reads the whole status, returning the address counter.
+delay waits out an execution time in the transport's own way, NULL
+to sleep through it. batch_flush sends whatever a buffering transport is
+holding back; the core calls it before every sleep and at the end of every
+engine pass. park puts the lines in their idle power state while the
+display is off, NULL if there is nothing to do; the next byte sent takes
+them out of it again. */
+struct lcd_bus_ops {
+    const char *name;
+    int (*attach)(struct lcd_data *lcd);
+    void (*detach)(struct lcd_data *lcd);
+    void (*send_nibble)(struct lcd_data *lcd, unsigned int nib, int rs);
+    void (*send_byte)(struct lcd_data *lcd, uint8_t byte, int rs);
+    void (*read_mode)(struct lcd_data *lcd, int on);
+    int (*read_busy)(struct lcd_data *lcd);
+    int (*read_addr)(struct lcd_data *lcd);
+    void (*delay)(struct lcd_data *lcd, unsigned int us);
+    void (*batch_flush)(struct lcd_data *lcd);
+    void (*park)(struct lcd_data *lcd);
+    void (*send_shared)(struct lcd_data *const *p, unsigned int n,
+                        uint8_t byte, int rs);
+};
+
+/* Panels wired to the same data lines, RS and RW, each with its own E
+line. The group holds the shared pins and one workqueue, so only one of
+its panels drives the lines at a time, and its transport's send_shared
+sends one byte to several of the panels in one go. Panels with the same
+data pins join the same group at probe. */
+struct lcd_group {
+    struct list_head node;          // in lcd_groups
+    struct mutex lock;              // guards panels
+    struct list_head panels;
+    int users;
+    unsigned int gpio_rs, gpio_rw;
+    unsigned int gpio_db[8];
+    bool bus8;
+    struct workqueue_struct *wq;
+};
+
+/* A virtual console. fb is a page of its own so it can be mapped into
+userspace. */
+struct lcd_vc {
+    char *fb;                       // rows x cols of text written by programs
+    u8 glyph_at[LCD_MAX_CELLS];     // id + 1 of a cell's glyph, under lock
+    int users;                      // files on this console, under lock
+};
+
+/* One of these per panel. All bus traffic is done by the panel's transmit
+engine, a work item on an ordered workqueue of its own, so each LCD is
+only ever driven from one thread, that thread can sleep between enable
+strobes, and separate panels update in parallel.
+
+cmdq and urgq are kfifos with the engine as their only reader, so the
+engine takes entries out without a lock and producers serialise among
+themselves on qlock. lock guards the consoles, the glyph table and the
+marquee settings. write()s only hold it to copy in what they have staged
+in their file's own buffer, and the engine only holds it to read those
+out: the glyphs while planning a flush, the marquee text, and the console
+to show. It never holds lock while driving the bus. The engine shows the
+framebuffer of console fg, which userspace may store into without any
+locking; every cell is a single byte, and whoever changes it schedules a
+flush afterwards, so the engine never misses an update. shown, ac and the
+other LCD state belong to the engine alone.
+
+Panels in a group share one workqueue instead, and their flushes are sent
+together by lcd_group_flush(), which holds the group's own lock across
+the transfer. */
 struct lcd_data {
-    int lcd_mjr;
-    struct class *lcd_class;
+    struct kref ref;                // probe and every open file
+    struct cdev *cdev;              // apart, the VFS may outlive lcd_data
+    int minor;
+    struct device *parent;          // the platform device
+    struct device *dev;             // the /dev node
     spinlock_t lock;    
+    int rows, cols;
+    uint8_t row_addr[LCD_MAX_ROWS]; // DDRAM address of each row
+    struct lcd_vc vc[LCD_VC_MAX];
+    unsigned int fg;                // console shown, under lock
+    char shown[LCD_MAX_CELLS];      // text last sent to the LCD
+    int ac;                         // LCD address counter, or LCD_AC_*
+    uint8_t entry;                  // last entry mode instruction sent
+    uint8_t display;                // last display control instruction sent
+    bool shifted;                   // display shifted by a raw instruction
+    bool resync;                    // shown is stale, resend every cell
+    struct lcd_glyph_def glyphs[LCD_GLYPH_MAX]; // under lock
+    struct lcd_glyph_slot slot[LCD_CGRAM_SLOTS];
+    unsigned long glyph_clock;      // flushes that showed glyphs
+    DECLARE_KFIFO(cmdq, struct lcd_op, LCD_CMDQ_LEN);
+    DECLARE_KFIFO(urgq, struct lcd_op, LCD_URGENT_MAX); // priority lane
+    spinlock_t qlock;               // serialises cmdq producers
+    wait_queue_head_t waitq;        // woken when cmdq has drained
+    struct workqueue_struct *wq;
+    struct work_struct work;        // transmit engine: init and commands
+    struct delayed_work flush_work; // transmit engine: framebuffer flush
+    struct delayed_work refresh;    // kicks the flush while mapped
+    struct delayed_work mq_work;    // transmit engine: marquee steps
+    u8 mq_text[2][LCD_LINE_LEN];    // marquee to show, under lock
+    unsigned int mq_period;         // ms per step, 0 when off, under lock
+    unsigned int mq_gen;            // bumped by every LCD_IOC_MARQUEE
+    unsigned int mq_loaded;         // mq_gen of the text in display RAM
+    bool marquee;                   // display RAM holds a marquee, not fb
+    struct delayed_work vc_work;    // takes turns between the consoles
+    struct work_struct sleep_work;  // display off once runtime suspended
+    bool asleep;                    // display off and transport parked
+    struct lcd_op plan[LCD_PLAN_MAX];   // what the current flush sends
+    short plan_tag[LCD_PLAN_MAX];   // LCD_TAG_* or the cell of each op
+    unsigned int plan_len;
+    unsigned long frame_gen;        // flushes planned
+    unsigned long frame_done;       // frame_gen of the last one sent whole
+    DECLARE_BITMAP(stale, LCD_MAX_CELLS);   // cells a cut-short flush left out
+    bool dying;                     // being removed, under lock and qlock
+    unsigned int max_fps;           // flush rate limit, 0 for none
+    unsigned long last_flush;       // jiffies at the start of the last flush
+    atomic_t mapped;                // mappings of any console
+    bool ready;                     // lcd_init() has run
+    bool bf_ok;                     // busy flag can be polled
+    bool bus8;                      // 8-bit data bus
+    const struct lcd_timing *timing;    // set from sysfs at any time
+    const struct lcd_bus_ops *ops;  // transport the LCD is reached over
+    struct lcd_group *group;        // shared data lines, NULL over I2C
+    struct list_head group_node;
+    unsigned int gpio_rs, gpio_rw, gpio_e;
+    unsigned int gpio_db[8];        // DB0-DB7
+    void __iomem *gpio_base;        // mapped GPIO registers, or NULL
+    struct lcd_nib_mask nib_mask[16];   // DB7-DB4 register masks
+    struct lcd_nib_mask low_mask[16];   // DB3-DB0 register masks
+    int i2c_bus;
+    unsigned short i2c_addr;
+    struct i2c_client *i2c;         // PCF8574 backpack, or NULL for GPIO
+    u8 i2c_buf[LCD_I2C_BUF];        // expander bytes not yet transferred
+    unsigned int i2c_len;
+    u8 i2c_out;                     // last byte given to the expander
+    struct lcd_stats stats;
+    struct dentry *debugfs;
+    struct lcd_bench *bench;        // last results, under lcd_bench_mutex
 };
 
-static struct lcd_data lcd = {
-    .lcd_mjr=0,
-    .lcd_class=NULL,
+/* What an open file writes to. write() lays text out in stage at the
+file's own cursor without touching the panel, then copies just the cells
+it changed into the console in one go. mutex serialises the file's own
+write()s and batches. */
+struct lcd_file {
+    struct lcd_data *lcd;
+    unsigned int vc;                // console, under lcd->lock
+    struct mutex mutex;
+    int row, col;                   // write() cursor
+    char stage[LCD_MAX_CELLS];
+    DECLARE_BITMAP(dirty, LCD_MAX_CELLS);   // cells of stage to copy in
+    struct lcd_op *batch;           // LCD_IOC_BATCH buffer, on first use
 };
 
+static int lcd_mjr;
+static struct class *lcd_class;
+static DEFINE_IDA(lcd_ida);             // minors in use
+static struct lcd_data *lcd_devs[LCD_MAX_DEVS]; // by minor, under lcd_devs_lock
+static DEFINE_SPINLOCK(lcd_devs_lock);
+static LIST_HEAD(lcd_groups);
+static DEFINE_MUTEX(lcd_group_mutex);   // guards lcd_groups and group users
+static DEFINE_MUTEX(lcd_bench_mutex);   // one benchmark at a time
+static struct platform_device *lcd_param_pdev[LCD_MAX_DEVS];
+static struct dentry *lcd_debugfs;      // lcd/ in debugfs, one dir per panel
+
+/* Have the framebuffer flushed, but no sooner than one frame after the
+last flush. Changes made while a flush is already pending are picked up
+by that flush instead of causing another. update is set for the updates
+userspace makes, the only ones counted as coalesced; refreshes, syncs and
+the engine's own flushes are not updates. */
+static void lcd_schedule_flush(struct lcd_data *lcd, bool update){
+    unsigned int fps = ACCESS_ONCE(lcd->max_fps);
+    unsigned long period, next, delay = 0;
+
+    if (fps) {
+        period = msecs_to_jiffies(1000 / fps);
+        next = lcd->last_flush + period;
+        if (time_before(jiffies, next))
+            delay = min(next - jiffies, period);
+    }
+    if (!queue_delayed_work(lcd->wq, &lcd->flush_work, delay) && update)
+        atomic_inc(&lcd->stats.coalesced);
+}
+
+// Room left on the command queue or the priority lane
+static unsigned int lcd_q_avail(struct lcd_data *lcd, bool urgent){
+    return urgent ? kfifo_avail(&lcd->urgq) : kfifo_avail(&lcd->cmdq);
+}
+
+/* Queue a batch of instructions and characters from userspace. The whole
+array is copied in with one copy_from_user() and queued in one go, so
+the engine sends it back-to-back. If the queue is too full the caller
+sleeps until the engine has made room, or gets -EAGAIN with O_NONBLOCK.
+The array is copied into a buffer the file keeps for its batches. */
+static long lcd_ioctl_batch(struct lcd_file *f, struct file *filp, struct lcd_batch __user *ubatch){
+    struct lcd_data *lcd = f->lcd;
+    struct lcd_batch batch;
+    struct lcd_op *ops;
+    unsigned int i;
+    bool urgent;
+    long ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    urgent = batch.flags & LCD_BATCH_URGENT;
+    if (batch.flags & ~LCD_BATCH_URGENT || batch.count == 0 ||
+        batch.count > (urgent ? LCD_URGENT_MAX : LCD_BATCH_MAX))
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&f->mutex))
+        return -ERESTARTSYS;
+    if (!f->batch)
+        f->batch = kmalloc(LCD_BATCH_MAX * sizeof(*f->batch), GFP_KERNEL);
+    ops = f->batch;
+    if (!ops) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(ops, (const void __user *)(unsigned long)batch.ops,
+                       batch.count * sizeof(*ops))) {
+        ret = -EFAULT;
+        goto out;
+    }
+    for (i = 0; i < batch.count; i++) {
+        if (ops[i].rs > 1) {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+    if (!urgent)
+        ops[batch.count - 1].rs |= LCD_OP_END;
+
+    for (;;) {
+        spin_lock(&lcd->qlock);
+        if (lcd->dying) {
+            spin_unlock(&lcd->qlock);
+            ret = -ENODEV;
+            goto out;
+        }
+        if (lcd_q_avail(lcd, urgent) >= batch.count) {
+            if (urgent)
+                kfifo_in(&lcd->urgq, ops, batch.count);
+            else
+                kfifo_in(&lcd->cmdq, ops, batch.count);
+            lcd->stats.hwm = max(lcd->stats.hwm, kfifo_len(&lcd->cmdq));
+            trace_lcd_enqueue(lcd->minor, batch.count, urgent);
+            queue_work(lcd->wq, &lcd->work);
+            spin_unlock(&lcd->qlock);
+            break;
+        }
+        spin_unlock(&lcd->qlock);
+
+        if (filp->f_flags & O_NONBLOCK) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        if (wait_event_interruptible(lcd->waitq,
+                                     lcd_q_avail(lcd, urgent) >= batch.count ||
+                                     lcd->dying)) {
+            ret = -ERESTARTSYS;
+            goto out;
+        }
+    }
+out:
+    mutex_unlock(&f->mutex);
+    return ret;
+}
+
+/* Register or change a custom character. Cells already showing it pick up
+the change on the next flush, with one upload of its rows. */
+static long lcd_ioctl_set_glyph(struct lcd_data *lcd, struct lcd_glyph __user *ug){
+    struct lcd_glyph g;
+    struct lcd_glyph_def *def;
+    unsigned int i;
+
+    if (copy_from_user(&g, ug, sizeof(g)))
+        return -EFAULT;
+    if (g.id >= LCD_GLYPH_MAX)
+        return -EINVAL;
+    spin_lock(&lcd->lock);
+    if (lcd->dying) {
+        spin_unlock(&lcd->lock);
+        return -ENODEV;
+    }
+    def = &lcd->glyphs[g.id];
+    for (i = 0; i < 8; i++)
+        def->rows[i] = g.rows[i] & 0x1f;
+    if (!++def->gen)
+        def->gen = 1;
+    lcd_schedule_flush(lcd, true);
+    spin_unlock(&lcd->lock);
+    return 0;
+}
+
+// Place a registered glyph into a cell of the file's console
+static long lcd_ioctl_put_glyph(struct lcd_file *f, struct lcd_glyph_pos __user *upos){
+    struct lcd_data *lcd = f->lcd;
+    struct lcd_glyph_pos pos;
+    struct lcd_vc *vc;
+    unsigned int i;
+    long ret = 0;
+
+    if (copy_from_user(&pos, upos, sizeof(pos)))
+        return -EFAULT;
+    if (pos.id >= LCD_GLYPH_MAX || pos.row >= lcd->rows || pos.col >= lcd->cols)
+        return -EINVAL;
+    i = pos.row * lcd->cols + pos.col;
+    spin_lock(&lcd->lock);
+    if (lcd->dying) {
+        ret = -ENODEV;
+    } else if (!lcd->glyphs[pos.id].gen) {
+        ret = -ENOENT;
+    } else {
+        vc = &lcd->vc[f->vc];
+        vc->fb[i] = LCD_GLYPH_CELL;
+        vc->glyph_at[i] = pos.id + 1;
+        lcd_schedule_flush(lcd, true);
+    }
+    spin_unlock(&lcd->lock);
+    return ret;
+}
+
+/* Start, replace or stop the marquee. The engine loads the text and then
+steps it on its own timer, one instruction per step. */
+static long lcd_ioctl_marquee(struct lcd_data *lcd, struct lcd_marquee __user *um){
+    struct lcd_marquee mq;
+
+    if (copy_from_user(&mq, um, sizeof(mq)))
+        return -EFAULT;
+    if (mq.flags || (mq.period_ms && mq.period_ms < LCD_MARQUEE_MIN_MS))
+        return -EINVAL;
+    // the display shift moves rows 3 and 4 into rows 1 and 2
+    if (lcd->rows > 2)
+        return -EINVAL;
+    spin_lock(&lcd->lock);
+    if (lcd->dying) {
+        spin_unlock(&lcd->lock);
+        return -ENODEV;
+    }
+    memcpy(lcd->mq_text, mq.text, sizeof(lcd->mq_text));
+    lcd->mq_period = mq.period_ms;
+    lcd->mq_gen++;
+    mod_delayed_work(lcd->wq, &lcd->mq_work, 0);
+    spin_unlock(&lcd->lock);
+    return 0;
+}
+
+/* Wait for a flush planned after every change made so far, so that they
+are all on the LCD once it returns. */
+static long lcd_ioctl_sync(struct lcd_data *lcd){
+    unsigned long gen;
+
+    spin_lock(&lcd->lock);
+    if (lcd->dying) {
+        spin_unlock(&lcd->lock);
+        return -ENODEV;
+    }
+    lcd_schedule_flush(lcd, false);
+    spin_unlock(&lcd->lock);
+    // pairs with lcd_plan()
+    smp_mb();
+    gen = ACCESS_ONCE(lcd->frame_gen);
+    if (wait_event_interruptible(lcd->waitq,
+                                 (long)(ACCESS_ONCE(lcd->frame_done) - gen) > 0 ||
+                                 lcd->dying))
+        return -ERESTARTSYS;
+    return lcd->dying ? -ENODEV : 0;
+}
+
+static long lcd_ioctl_stats(struct lcd_data *lcd, struct lcd_stats_info __user *ustats){
+    struct lcd_stats_info st;
+
+    st.bytes = lcd->stats.bytes;
+    st.frames = lcd->stats.frames;
+    st.coalesced = atomic_read(&lcd->stats.coalesced);
+    st.skipped = lcd->stats.skipped;
+    if (copy_to_user(ustats, &st, sizeof(st)))
+        return -EFAULT;
+    return 0;
+}
+
+// Move a file to another console, or show another console on the panel
+static long lcd_ioctl_vc(struct lcd_file *f, unsigned int cmd, __u32 __user *uvc){
+    struct lcd_data *lcd = f->lcd;
+    __u32 n;
+
+    if (get_user(n, uvc))
+        return -EFAULT;
+    if (n >= LCD_VC_MAX)
+        return -EINVAL;
+    spin_lock(&lcd->lock);
+    if (cmd == LCD_IOC_SELECT_VC) {
+        lcd->vc[f->vc].users--;
+        lcd->vc[n].users++;
+        f->vc = n;
+    } else if (!lcd->dying) {
+        // the next flush sends only what differs from the console shown
+        lcd->fg = n;
+        lcd_schedule_flush(lcd, true);
+    }
+    spin_unlock(&lcd->lock);
+    return 0;
+}
+
 static long lcd_ioctl(struct file * flip, unsigned int cmd, unsigned long arg){
+    struct lcd_file *f = flip->private_data;
+    struct lcd_data *lcd = f->lcd;
+    struct lcd_geometry geo;
+    __u32 fps;
+
+    switch (cmd) {
+    case LCD_IOC_BATCH:
+        return lcd_ioctl_batch(f, flip, (struct lcd_batch __user *)arg);
+    case LCD_IOC_SET_GLYPH:
+        return lcd_ioctl_set_glyph(lcd, (struct lcd_glyph __user *)arg);
+    case LCD_IOC_PUT_GLYPH:
+        return lcd_ioctl_put_glyph(f, (struct lcd_glyph_pos __user *)arg);
+    case LCD_IOC_MARQUEE:
+        return lcd_ioctl_marquee(lcd, (struct lcd_marquee __user *)arg);
+    case LCD_IOC_SELECT_VC:
+    case LCD_IOC_SHOW_VC:
+        return lcd_ioctl_vc(f, cmd, (__u32 __user *)arg);
+    case LCD_IOC_SYNC:
+        return lcd_ioctl_sync(lcd);
+    case LCD_IOC_GET_STATS:
+        return lcd_ioctl_stats(lcd, (struct lcd_stats_info __user *)arg);
+    case LCD_IOC_GET_GEOMETRY:
+        geo.rows = lcd->rows;
+        geo.cols = lcd->cols;
+        if (copy_to_user((void __user *)arg, &geo, sizeof(geo)))
+            return -EFAULT;
+        return 0;
+    case LCD_IOC_SET_MAX_FPS:
+        if (get_user(fps, (__u32 __user *)arg))
+            return -EFAULT;
+        if (fps > LCD_MAX_FPS_LIMIT)
+            return -EINVAL;
+        lcd->max_fps = fps;
+        return 0;
+    case LCD_IOC_GET_MAX_FPS:
+        return put_user(lcd->max_fps, (__u32 __user *)arg);
+    }
     return -EINVAL;
 }
 
+// Stage one written character at the file's cursor
+static void lcd_fb_putc(struct lcd_data *lcd, struct lcd_file *f, char ch){
+    int i;
+
+    switch (ch) {
+    case '\n':
+        // blank the rest of the row and start the next one
+        for (i = f->col; i < lcd->cols; i++) {
+            f->stage[f->row * lcd->cols + i] = ' ';
+            set_bit(f->row * lcd->cols + i, f->dirty);
+        }
+        f->row = (f->row + 1) % lcd->rows;
+        f->col = 0;
+        break;
+    case '\r':
+        f->col = 0;
+        break;
+    case '\f':
+        memset(f->stage, ' ', lcd->rows * lcd->cols);
+        bitmap_fill(f->dirty, lcd->rows * lcd->cols);
+        f->row = 0;
+        f->col = 0;
+        break;
+    default:
+        /* The wrap is deferred until the next character so that a line
+        of exactly cols characters followed by a newline does not skip
+        a row. */
+        if (f->col == lcd->cols) {
+            f->row = (f->row + 1) % lcd->rows;
+            f->col = 0;
+        }
+        i = f->row * lcd->cols + f->col++;
+        f->stage[i] = ch;
+        set_bit(i, f->dirty);
+        break;
+    }
+}
+
+/* Copy the cells a write() staged into the file's console. This is the
+only part of a write() that holds the panel lock, and it is at most one
+pass over the cells however much was written. */
+static int lcd_commit(struct lcd_data *lcd, struct lcd_file *f){
+    unsigned int i, n = lcd->rows * lcd->cols;
+    struct lcd_vc *vc;
+
+    spin_lock(&lcd->lock);
+    if (lcd->dying) {
+        spin_unlock(&lcd->lock);
+        return -ENODEV;
+    }
+    vc = &lcd->vc[f->vc];
+    for_each_set_bit(i, f->dirty, n) {
+        vc->fb[i] = f->stage[i];
+        vc->glyph_at[i] = 0;
+    }
+    // under the lock, so nothing is queued once remove has begun
+    if (f->vc == lcd->fg)
+        lcd_schedule_flush(lcd, true);
+    spin_unlock(&lcd->lock);
+    bitmap_zero(f->dirty, LCD_MAX_CELLS);
+    return 0;
+}
+
+static ssize_t lcd_file_write(struct file *filp, const char __user *buf,
+                              size_t count, loff_t *f_pos){
+    struct lcd_file *f = filp->private_data;
+    struct lcd_data *lcd = f->lcd;
+    char kbuf[64];
+    size_t done = 0;
+    size_t i, n;
+    int ret;
+
+    if (mutex_lock_interruptible(&f->mutex))
+        return -ERESTARTSYS;
+    while (done < count) {
+        n = min(count - done, sizeof(kbuf));
+        if (copy_from_user(kbuf, buf + done, n))
+            break;
+        for (i = 0; i < n; i++)
+            lcd_fb_putc(lcd, f, kbuf[i]);
+        done += n;
+    }
+    ret = lcd_commit(lcd, f);
+    mutex_unlock(&f->mutex);
+
+    if (ret)
+        return ret;
+    if (done == 0 && count > 0)
+        return -EFAULT;
+    return done;
+}
+
+static void lcd_vm_open(struct vm_area_struct *vma){
+    struct lcd_data *lcd = vma->vm_private_data;
+
+    // the first mapping starts the periodic refresh
+    spin_lock(&lcd->lock);
+    if (atomic_inc_return(&lcd->mapped) == 1 && !lcd->dying)
+        queue_delayed_work(lcd->wq, &lcd->refresh, 0);
+    spin_unlock(&lcd->lock);
+}
+
+static void lcd_vm_close(struct vm_area_struct *vma){
+    struct lcd_data *lcd = vma->vm_private_data;
+
+    atomic_dec(&lcd->mapped);
+}
+
+static const struct vm_operations_struct lcd_vm_ops = {
+    .open=lcd_vm_open,
+    .close=lcd_vm_close,
+};
+
+/* Map the framebuffer of the file's console into userspace. Programs
+store characters straight into it and the refresh work flushes whatever
+changed, with no system call per update. */
+static int lcd_mmap(struct file *filp, struct vm_area_struct *vma){
+    struct lcd_file *f = filp->private_data;
+    struct lcd_data *lcd = f->lcd;
+    int ret;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+    // stores into a private mapping would land in a copy and never be shown
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    ret = vm_insert_page(vma, vma->vm_start, virt_to_page(lcd->vc[ACCESS_ONCE(f->vc)].fb));
+    if (ret)
+        return ret;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &lcd_vm_ops;
+    vma->vm_private_data = lcd;
+    lcd_vm_open(vma);
+    return 0;
+}
+
+// Flush periodically while fb is mapped
+static void lcd_refresh(struct work_struct *work){
+    struct lcd_data *lcd = container_of(to_delayed_work(work),
+                                        struct lcd_data, refresh);
+
+    lcd_schedule_flush(lcd, false);
+    if (atomic_read(&lcd->mapped))
+        queue_delayed_work(lcd->wq, &lcd->refresh, msecs_to_jiffies(refresh_ms));
+}
+
+/* write() never blocks, since text only lands in the framebuffer, so the
+device is writable whenever a batch of the largest size would fit in the
+command queue without waiting. */
+static unsigned int lcd_poll(struct file *filp, poll_table *wait){
+    struct lcd_data *lcd = ((struct lcd_file *)filp->private_data)->lcd;
+
+    poll_wait(filp, &lcd->waitq, wait);
+    if (lcd->dying)
+        return POLLERR;
+    if (kfifo_avail(&lcd->cmdq) >= LCD_BATCH_MAX)
+        return POLLOUT | POLLWRNORM;
+    return 0;
+}
+
+// Free a panel once it is removed and the last open file is closed
+static void lcd_free(struct kref *ref){
+    struct lcd_data *lcd = container_of(ref, struct lcd_data, ref);
+    unsigned int i;
+
+    for (i = 0; i < LCD_VC_MAX; i++)
+        free_page((unsigned long)lcd->vc[i].fb);
+    kfree(lcd);
+}
+
+/* The pins and the LCD stay set up from probe to remove, so opening and
+closing the device only take and drop a reference on the panel. The panel
+is looked up by minor rather than from the inode's cdev, which can still
+be opened after remove has taken the panel out of lcd_devs. A new file
+starts out on console 0. */
 static int lcd_open(struct inode *inode, struct file *filp){
+    struct lcd_data *lcd;
+    struct lcd_file *f;
+
+    spin_lock(&lcd_devs_lock);
+    lcd = lcd_devs[iminor(inode)];
+    if (lcd)
+        kref_get(&lcd->ref);
+    spin_unlock(&lcd_devs_lock);
+    if (!lcd)
+        return -ENODEV;
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    if (!f) {
+        kref_put(&lcd->ref, lcd_free);
+        return -ENOMEM;
+    }
+    f->lcd = lcd;
+    mutex_init(&f->mutex);
+    spin_lock(&lcd->lock);
+    lcd->vc[0].users++;
+    spin_unlock(&lcd->lock);
+    filp->private_data = f;
     return 0;
 }
 
 static int lcd_release(struct inode *inode, struct file *filp){
-    // Free gpio pins from using process
-    spin_lock(&lcd.lock);
-    gpio_free(4);
-    gpio_free(17);
-    gpio_free(18);
-    gpio_free(22);
-    gpio_free(23);
-    gpio_free(24);
-    gpio_free(25);
-    spin_unlock(&lcd.lock);
+    struct lcd_file *f = filp->private_data;
+    struct lcd_data *lcd = f->lcd;
+
+    spin_lock(&lcd->lock);
+    lcd->vc[f->vc].users--;
+    spin_unlock(&lcd->lock);
+    kfree(f->batch);
+    kfree(f);
+    kref_put(&lcd->ref, lcd_free);
     return 0;
 }
 
@@ -100,162 +1067,1968 @@ static char *lcd_devnode(struct device *dev, umode_t *mode){
     return NULL;
 }
 
-// Initialize the LCD
-static int lcd_init(void){
-    spin_lock(&lcd.lock);
-    mdelay(15);
-    lcd_write(reset);
-    mdelay(35);
-    lcd_write(startup1);
-    lcd_write(startup2);
-    lcd_write(functionset);
-    lcd_write(displayoff);
-    lcd_write(clear);
-    lcd_write(entry);
-    lcd_write(displayon);
-    lcd_write(home);
-    gpio_set_value(4,1);
-    mdelay(35);
-    lcd_write(a);
-    mdelay(35);
-    gpio_set_value(4,0);
-    spin_unlock(&lcd.lock);
+/* Whether the controller is already running in our bus mode. Two DDRAM
+addresses are set and read back: a cold controller is still in 8-bit mode
+and takes each nibble of a 4-bit write as an instruction of its own, the
+second of which points the address counter into CGRAM, so neither address
+reads back unless the controller is in 4-bit mode. On an 8-bit bus a cold
+controller already matches and reads both back, so there the probe tells
+nothing and the startup sequence always runs. */
+static bool lcd_is_warm(struct lcd_data *lcd){
+    static const uint8_t probe[2] = {0x05, 0x4a};
+    unsigned int i;
+    int ac;
+
+    if (warm_start == 2)
+        return true;
+    if (warm_start != 1 || lcd->bus8 || !lcd->ops->read_addr)
+        return false;
+    for (i = 0; i < ARRAY_SIZE(probe); i++) {
+        lcd_write(lcd, LCD_DDRAM | probe[i], 0);
+        lcd->ops->read_mode(lcd, 1);
+        ac = lcd->ops->read_addr(lcd);
+        lcd->ops->read_mode(lcd, 0);
+        if (ac != probe[i])
+            return false;
+    }
+    return true;
+}
+
+// Initialize the LCD. Runs on the transmit engine, so it may sleep.
+static int lcd_init(struct lcd_data *lcd){
+    uint8_t fs = lcd->bus8 ? LCD_FUNCTIONSET | LCD_FS_8BIT : LCD_FUNCTIONSET;
+    bool warm;
+
+    /* Until the LCD is in 4-bit mode it still takes the upper nibble alone
+    as an 8-bit instruction, and the busy flag cannot be read, so the
+    startup nibbles are sent one at a time with the datasheet's waits.
+    In 8-bit mode the same wake-up is three whole bytes. */
+    lcd->bf_ok = false;
+    lcd_forget_glyphs(lcd);
+    warm = lcd_is_warm(lcd);
+    if (warm)
+        goto configure;
+    lcd_pause(lcd, 15000);
+    lcd_write(lcd, LCD_RESET, 0);
+    lcd_pause(lcd, 35000);
+    if (lcd->bus8) {
+        lcd->ops->send_byte(lcd, LCD_STARTUP8, 0);
+        lcd_pause(lcd, 4100);
+        lcd->ops->send_byte(lcd, LCD_STARTUP8, 0);
+        lcd_pause(lcd, 100);
+        lcd->ops->send_byte(lcd, LCD_STARTUP8, 0);
+        lcd_pause(lcd, 100);
+    } else {
+        lcd->ops->send_nibble(lcd, LCD_STARTUP1 >> 4, 0);
+        lcd_pause(lcd, 4100);
+        lcd->ops->send_nibble(lcd, LCD_STARTUP1 & 0xf, 0);
+        lcd_pause(lcd, 100);
+        lcd->ops->send_nibble(lcd, LCD_STARTUP2 >> 4, 0);
+        lcd_pause(lcd, 100);
+        lcd->ops->send_nibble(lcd, LCD_STARTUP2 & 0xf, 0);
+        lcd_pause(lcd, 100);
+    }
+configure:
+    lcd->bf_ok = busy_poll && lcd->ops->read_busy;
+    // a single-row panel runs the controller in one-line mode
+    if (lcd->rows == 1)
+        fs &= ~LCD_FS_2LINE;
+    lcd_write(lcd, fs, 0);
+    lcd->entry = LCD_ENTRY;
+    if (warm) {
+        /* Whatever the last user left on the display stays there until
+        the first flush, which rewrites every cell and undoes any shift. */
+        dev_info(lcd->parent, "controller already up, skipping startup\n");
+        lcd_write(lcd, LCD_ENTRY, 0);
+        lcd_write(lcd, LCD_DISPLAYON, 0);
+        lcd->display = LCD_DISPLAYON;
+        memset(lcd->shown, ' ', sizeof(lcd->shown));
+        lcd->ac = LCD_AC_UNKNOWN;
+        lcd->shifted = true;
+        lcd->resync = true;
+        return 0;
+    }
+    lcd_write(lcd, LCD_DISPLAYOFF, 0);
+    lcd_write(lcd, LCD_CLEAR, 0);
+    lcd_write(lcd, LCD_ENTRY, 0);
+    lcd_write(lcd, LCD_DISPLAYON, 0);
+    lcd->display = LCD_DISPLAYON;
+    lcd_write(lcd, LCD_HOME, 0);
+    // the display starts out blank, like the framebuffer
+    memset(lcd->shown, ' ', sizeof(lcd->shown));
+    lcd->ac = 0;
+    lcd->shifted = false;
+    lcd->resync = false;
     return 0;
 }
  
-//Write to the LCD
-static int lcd_write(const uint8_t data[]){
-    /* In 4-bit mode, data is transmitted only over the upper
-    four data pins (DB4-DB7). These pins are connected to the RPi's
-    GPIO pins 22, 23, 24, and 25, respectively. If the data to be
-    sent is 8-bits, the most significant four digits are sent first,
-    followed by the second.	*/
-    gpio_set_value(25, data[0]);
-    gpio_set_value(24, data[1]);
-    gpio_set_value(23, data[2]);
-    gpio_set_value(22, data[3]);
-    gpio_set_value(18, 1);
-    udelay(50);
-    gpio_set_value(18, 0);
-    udelay(50);
-    gpio_set_value(25, data[4]);
-    gpio_set_value(24, data[5]);
-    gpio_set_value(23, data[6]);
-    gpio_set_value(22, data[7]);
-    gpio_set_value(18, 1);
-    udelay(50);
-    gpio_set_value(18, 0);
-    udelay(50);	
+/* Core side of the bus. Everything above the transport ops goes through
+these, so the framebuffer, queue and flush logic is the same whatever
+the LCD is wired to. */
+
+// Push out anything the transport is still holding back
+static void lcd_bus_flush(struct lcd_data *lcd){
+    if (lcd->ops->batch_flush)
+        lcd->ops->batch_flush(lcd);
+}
+
+// Sleep for us, once anything still buffered for the bus has gone out
+static void lcd_pause(struct lcd_data *lcd, unsigned int us){
+    lcd_bus_flush(lcd);
+    if (us >= 20000)
+        msleep(us / 1000);
+    else
+        usleep_range(us, us + us / 4 + 10);
+}
+
+/* Wait for the LCD to finish the instruction just sent, which takes about
+exec_us. With busy_poll this returns as soon as the busy flag drops;
+otherwise the transport waits out the execution time, by default by
+sleeping through it. */
+static void lcd_wait_ready(struct lcd_data *lcd, unsigned int exec_us){
+    ktime_t start;
+    u32 us;
+
+    if (!lcd->bf_ok) {
+        if (lcd->ops->delay)
+            lcd->ops->delay(lcd, exec_us);
+        else
+            lcd_pause(lcd, exec_us);
+        return;
+    }
+
+    lcd->ops->read_mode(lcd, 1);
+    start = ktime_get();
+    while (lcd->ops->read_busy(lcd)) {
+        if (ktime_us_delta(ktime_get(), start) > exec_us * LCD_BF_TIMEOUT) {
+            printk(KERN_WARNING "LCD busy flag stuck, using fixed delays\n");
+            lcd->bf_ok = false;
+            break;
+        }
+        // clear and home are long enough to sleep between polls
+        if (exec_us > ACCESS_ONCE(lcd->timing)->exec_us)
+            usleep_range(50, 100);
+    }
+    lcd->ops->read_mode(lcd, 0);
+    // 32 bits, so the division below needs no 64-bit helper on ARM
+    us = min_t(s64, ktime_us_delta(ktime_get(), start), U32_MAX);
+    lcd->stats.bf_wait[min(fls(us / 10), LCD_BF_BUCKETS - 1)]++;
+}
+
+// Execution time of a byte; clear and home (0000001x) are the slow ones
+static unsigned int lcd_exec_us(struct lcd_data *lcd, uint8_t byte, int rs){
+    const struct lcd_timing *t = ACCESS_ONCE(lcd->timing);
+
+    if (!rs && (byte == LCD_CLEAR || (byte & 0xfe) == LCD_HOME))
+        return t->slow_us;
+    return t->exec_us;
+}
+
+/* Wait out one half of an enable cycle, E high or E low, long enough for
+every one of the n panels strobed together. These are the only
+busy-waits on the bus. */
+static void lcd_e_wait(struct lcd_data *const *p, unsigned int n, bool high){
+    const struct lcd_timing *t;
+    unsigned int i, ns = 0;
+
+    for (i = 0; i < n; i++) {
+        t = ACCESS_ONCE(p[i]->timing);
+        ns = max(ns, high ? t->e_high_ns : t->e_low_ns);
+    }
+    ndelay(ns);
+}
 
+//Write an instruction (rs=0) or character (rs=1) to the LCD
+static int lcd_write(struct lcd_data *lcd, uint8_t byte, int rs){
+    ktime_t start;
+
+    trace_lcd_xmit(lcd->minor, byte, rs, 1);
+    lcd->ops->send_byte(lcd, byte, rs);
+    lcd->stats.bytes++;
+    start = ktime_get();
+    lcd_wait_ready(lcd, lcd_exec_us(lcd, byte, rs));
+    lcd->stats.wait_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
     return 0;
 }
 
-//Request GPIO pins
-static int req_gpio(void){	
-    /* GPIO pins are requested in the kernel with gpio_request. Labels
-    are assigned as parameters. Returns 0 on success, a negative number
-    on failure. */
-    if (gpio_request(4, "RS")) {
-        printk("GPIO request failure: %s\n", "RS");
-     	    return -1;
+/* GPIO transport through gpiolib. In 4-bit mode, data is transmitted only
+over the upper four data pins (DB4-DB7), by default the RPi's GPIO pins
+22, 23, 24, and 25, respectively. The most significant four bits are
+sent first, followed by the second. In 8-bit mode the whole byte goes
+out in one strobe. */
+
+/* Put RS and one bus-width value on the data lines and clock it into the
+LCD: a nibble on DB7-DB4 in 4-bit mode, a whole byte on DB7-DB0 in
+8-bit mode. */
+static void lcd_gpio_put(struct lcd_data *lcd, unsigned int val, int rs){
+    unsigned int i, hi = lcd->bus8 ? val >> 4 : val;
+
+    gpio_set_value(lcd->gpio_rs, rs);
+    for (i = 0; i < 4; i++)
+        gpio_set_value(lcd->gpio_db[4 + i], (hi >> i) & 1);
+    if (lcd->bus8) {
+        for (i = 0; i < 4; i++)
+            gpio_set_value(lcd->gpio_db[i], (val >> i) & 1);
     }
-    if (gpio_request(17, "RW")) {
-        printk("GPIO request failure: %s\n", "RW");
-        return -1;
+}
+
+static void lcd_gpio_strobe(struct lcd_data *lcd, unsigned int val, int rs){
+    lcd_gpio_put(lcd, val, rs);
+    gpio_set_value(lcd->gpio_e, 1);
+    lcd_e_wait(&lcd, 1, true);
+    gpio_set_value(lcd->gpio_e, 0);
+    lcd_e_wait(&lcd, 1, false);
+}
+
+// Leave RS and the data lines low, with E low they are ignored
+static void lcd_gpio_park(struct lcd_data *lcd){
+    lcd_gpio_put(lcd, 0, 0);
+}
+
+static void lcd_gpio_byte(struct lcd_data *lcd, uint8_t byte, int rs){
+    if (lcd->bus8) {
+        lcd_gpio_strobe(lcd, byte, rs);
+    } else {
+        lcd_gpio_strobe(lcd, byte >> 4, rs);
+        lcd_gpio_strobe(lcd, byte & 0xf, rs);
     }
-    if (gpio_request(18, "E")) {
-        printk("GPIO request failure: %s\n", "E");
-        return -1;
+}
+
+/* Send one byte to n panels sharing the data lines: each value is put on
+the lines once and clocked into all of them by pulsing their E lines
+together. */
+static void lcd_gpio_shared(struct lcd_data *const *p, unsigned int n,
+                            uint8_t byte, int rs){
+    unsigned int val[2] = {byte >> 4, byte & 0xf};
+    unsigned int k, i;
+
+    for (k = p[0]->bus8 ? 1 : 0; k < 2; k++) {
+        lcd_gpio_put(p[0], p[0]->bus8 ? byte : val[k], rs);
+        for (i = 0; i < n; i++)
+            gpio_set_value(p[i]->gpio_e, 1);
+        lcd_e_wait(p, n, true);
+        for (i = 0; i < n; i++)
+            gpio_set_value(p[i]->gpio_e, 0);
+        lcd_e_wait(p, n, false);
     }
-    if (gpio_request(22, "DB4")) {
-        printk("GPIO request failure: %s\n", "DB4");
-        return -1;
+}
+
+/* Turn the data lines around for reading the busy flag, or back. All of
+them are switched, not just DB7, since the LCD drives the others with the
+address counter during the read. Shared by both GPIO transports. */
+static void lcd_gpio_read_mode(struct lcd_data *lcd, int on){
+    unsigned int i, first = lcd->bus8 ? 0 : 4;
+
+    if (on) {
+        for (i = first; i < 8; i++)
+            gpio_direction_input(lcd->gpio_db[i]);
+        gpio_set_value(lcd->gpio_rs, 0);
+        gpio_set_value(lcd->gpio_rw, 1);
+    } else {
+        gpio_set_value(lcd->gpio_rw, 0);
+        for (i = first; i < 8; i++)
+            gpio_direction_output(lcd->gpio_db[i], 0);
     }
-    if (gpio_request(23, "DB5")) {
-        printk("GPIO request failure: %s\n", "DB5");
-        return -1;
+}
+
+// Clock one read cycle out of the LCD and return DB7 (RW must be high)
+static int lcd_gpio_read_busy(struct lcd_data *lcd){
+    int bf;
+
+    gpio_set_value(lcd->gpio_e, 1);
+    lcd_e_wait(&lcd, 1, true);
+    bf = gpio_get_value(lcd->gpio_db[7]);
+    gpio_set_value(lcd->gpio_e, 0);
+    lcd_e_wait(&lcd, 1, false);
+    // in 4-bit mode the low nibble of the address counter follows
+    if (!lcd->bus8) {
+        gpio_set_value(lcd->gpio_e, 1);
+        lcd_e_wait(&lcd, 1, true);
+        gpio_set_value(lcd->gpio_e, 0);
+        lcd_e_wait(&lcd, 1, false);
     }
-    if (gpio_request(24, "DB6")) {
-        printk("GPIO request failure: %s\n", "DB6");
-        return -1;
+    return bf;
+}
+
+/* Clock the status out of the LCD (RW must be high), most significant
+nibble first in 4-bit mode, and return the address counter. Only used
+once at startup, so the fast transport reads it through gpiolib too. */
+static int lcd_gpio_read_addr(struct lcd_data *lcd){
+    unsigned int i, k, first = lcd->bus8 ? 0 : 4, val = 0;
+
+    for (k = first ? 0 : 1; k < 2; k++) {
+        gpio_set_value(lcd->gpio_e, 1);
+        lcd_e_wait(&lcd, 1, true);
+        val <<= 8 - first;
+        for (i = first; i < 8; i++)
+            val |= gpio_get_value(lcd->gpio_db[i]) ? BIT(i - first) : 0;
+        gpio_set_value(lcd->gpio_e, 0);
+        lcd_e_wait(&lcd, 1, false);
     }
-    if (gpio_request(25, "DB7")) {
-        printk("GPIO request failure: %s\n", "DB7");
-        return -1;
+    return val & 0x7f;
+}
+
+/* Fast GPIO transport, writing the GPIO registers directly. The pins are
+requested and turned around through gpiolib, as for the GPIO transport,
+so nothing else can claim them. */
+static void lcd_mmio_enable(struct lcd_data *lcd, int on){
+    writel(BIT(lcd->gpio_e), lcd->gpio_base + (on ? GPSET0 : GPCLR0));
+}
+
+static void lcd_mmio_put(struct lcd_data *lcd, unsigned int val, int rs){
+    unsigned int hi = lcd->bus8 ? val >> 4 : val;
+    u32 set, clr;
+
+    set = lcd->nib_mask[hi].set | (rs ? BIT(lcd->gpio_rs) : 0);
+    clr = lcd->nib_mask[hi].clr | (rs ? 0 : BIT(lcd->gpio_rs));
+    if (lcd->bus8) {
+        set |= lcd->low_mask[val & 0xf].set;
+        clr |= lcd->low_mask[val & 0xf].clr;
     }
-	
-    // Set the acquired GPIO pins as outputs
-    gpio_direction_output( 4, 0);
-    gpio_direction_output(17, 0);
-    gpio_direction_output(18, 0);
-    gpio_direction_output(22, 0);
-    gpio_direction_output(23, 0);
-    gpio_direction_output(24, 0);
-    gpio_direction_output(25, 0);
+    writel(set, lcd->gpio_base + GPSET0);
+    writel(clr, lcd->gpio_base + GPCLR0);
+}
 
-    return 0;
+static void lcd_mmio_strobe(struct lcd_data *lcd, unsigned int val, int rs){
+    lcd_mmio_put(lcd, val, rs);
+    lcd_mmio_enable(lcd, 1);
+    lcd_e_wait(&lcd, 1, true);
+    lcd_mmio_enable(lcd, 0);
+    lcd_e_wait(&lcd, 1, false);
 }
 
-// Module init
-static int __init rpigpio_lcd_minit(void){
-    // initialize variables
-    struct device *dev=NULL;
-    int ret=0;
-	
-    printk(KERN_INFO "%s\n",SYSTIMER_MOD_DESCR);
-    printk(KERN_INFO "By: %s\n",SYSTIMER_MOD_AUTH);
+static void lcd_mmio_park(struct lcd_data *lcd){
+    lcd_mmio_put(lcd, 0, 0);
+}
 
-    // register character device
-    lcd.lcd_mjr=register_chrdev(0,"gpio_lcd",&lcd_fops);
-    if (lcd.lcd_mjr<0) {
-    	printk(KERN_NOTICE "Cannot register char device\n");
-        return lcd.lcd_mjr;
+static void lcd_mmio_byte(struct lcd_data *lcd, uint8_t byte, int rs){
+    if (lcd->bus8) {
+        lcd_mmio_strobe(lcd, byte, rs);
+    } else {
+        lcd_mmio_strobe(lcd, byte >> 4, rs);
+        lcd_mmio_strobe(lcd, byte & 0xf, rs);
     }
-    // create class for LCD for module
-    lcd.lcd_class=class_create(THIS_MODULE, "lcd_class");
-    if (IS_ERR(lcd.lcd_class)) {
-    	unregister_chrdev(lcd.lcd_mjr,"lcd_gpio");
-    	return PTR_ERR(lcd.lcd_class);
-    }
-    lcd.lcd_class->devnode=lcd_devnode;
-    // create device for LCD using registered device
-    dev=device_create(lcd.lcd_class,NULL,MKDEV(lcd.lcd_mjr,0),(void *)&lcd,"lcd");
-    if (IS_ERR(dev)) {
-    	class_destroy(lcd.lcd_class);
-    	unregister_chrdev(lcd.lcd_mjr,"lcd_gpio");
-    	return PTR_ERR(dev);
-     }
-	
-    // request gpio pins and initalize the lcd
-    if(req_gpio()<0){
-    	class_destroy(lcd.lcd_class);
-        unregister_chrdev(lcd.lcd_mjr,"lcd_gpio");
-        return PTR_ERR(dev);
+}
+
+// As lcd_gpio_shared(), with all the E lines raised in one register write
+static void lcd_mmio_shared(struct lcd_data *const *p, unsigned int n,
+                            uint8_t byte, int rs){
+    unsigned int val[2] = {byte >> 4, byte & 0xf};
+    unsigned int k, i;
+    u32 e = 0;
+
+    for (i = 0; i < n; i++)
+        e |= BIT(p[i]->gpio_e);
+    for (k = p[0]->bus8 ? 1 : 0; k < 2; k++) {
+        lcd_mmio_put(p[0], p[0]->bus8 ? byte : val[k], rs);
+        writel(e, p[0]->gpio_base + GPSET0);
+        lcd_e_wait(p, n, true);
+        writel(e, p[0]->gpio_base + GPCLR0);
+        lcd_e_wait(p, n, false);
+    }
+}
+
+static int lcd_mmio_read_busy(struct lcd_data *lcd){
+    int bf;
+
+    lcd_mmio_enable(lcd, 1);
+    lcd_e_wait(&lcd, 1, true);
+    bf = !!(readl(lcd->gpio_base + GPLEV0) & BIT(lcd->gpio_db[7]));
+    lcd_mmio_enable(lcd, 0);
+    lcd_e_wait(&lcd, 1, false);
+    if (!lcd->bus8) {
+        lcd_mmio_enable(lcd, 1);
+        lcd_e_wait(&lcd, 1, true);
+        lcd_mmio_enable(lcd, 0);
+        lcd_e_wait(&lcd, 1, false);
+    }
+    return bf;
+}
+
+/* PCF8574 transport. Expander bytes are only buffered here; the buffer
+is written in one I2C transfer when it fills, when the LCD has to be
+given time, and at the end of every engine pass. */
+static void lcd_i2c_flush(struct lcd_data *lcd){
+    int ret;
+
+    if (!lcd->i2c_len)
+        return;
+    ret = i2c_master_send(lcd->i2c, (char *)lcd->i2c_buf, lcd->i2c_len);
+    if (ret < 0)
+        printk_ratelimited(KERN_WARNING "LCD I2C write failed: %d\n", ret);
+    lcd->i2c_len = 0;
+}
+
+static void lcd_i2c_put(struct lcd_data *lcd, u8 out){
+    if (lcd->i2c_len == LCD_I2C_BUF)
+        lcd_i2c_flush(lcd);
+    lcd->i2c_buf[lcd->i2c_len++] = out;
+    lcd->i2c_out = out;
+}
+
+/* Clock one nibble into the LCD through the expander: the nibble with E
+high, then with E low. Each byte takes nine I2C clocks, far longer than
+the enable pulse needs, so no delays are added. */
+static void lcd_i2c_strobe(struct lcd_data *lcd, unsigned int nib, int rs){
+    u8 out = nib << 4 | (rs ? PCF_RS : 0) | PCF_BL;
+
+    lcd_i2c_put(lcd, out | PCF_E);
+    lcd_i2c_put(lcd, out);
+}
+
+// Turn the backlight off; the next strobe turns it back on
+static void lcd_i2c_park(struct lcd_data *lcd){
+    lcd_i2c_put(lcd, 0);
+}
+
+static void lcd_i2c_byte(struct lcd_data *lcd, uint8_t byte, int rs){
+    lcd_i2c_strobe(lcd, byte >> 4, rs);
+    lcd_i2c_strobe(lcd, byte & 0xf, rs);
+}
+
+/* Short instructions are waited out without ending the transfer, by
+repeating the idle byte; with E low the LCD ignores it, and the next
+strobe raises E one byte time from now in any case. Consecutive
+characters therefore share one transfer. */
+static void lcd_i2c_delay(struct lcd_data *lcd, unsigned int us){
+    unsigned int n = DIV_ROUND_UP(us * i2c_khz, 9000);
+
+    if (us > ACCESS_ONCE(lcd->timing)->exec_us) {
+        lcd_pause(lcd, us);
+        return;
+    }
+    while (n-- > 1)
+        lcd_i2c_put(lcd, lcd->i2c_out);
+}
+
+// Add one instruction (rs=0) or character (rs=1) to the flush plan
+static void lcd_plan_op(struct lcd_data *lcd, uint8_t val, int rs, int tag){
+    lcd->plan[lcd->plan_len].rs = rs;
+    lcd->plan[lcd->plan_len].val = val;
+    lcd->plan_tag[lcd->plan_len] = tag;
+    lcd->plan_len++;
+}
+
+// Forget what CGRAM holds, so every glyph is uploaded again when needed
+static void lcd_forget_glyphs(struct lcd_data *lcd){
+    unsigned int s;
+
+    for (s = 0; s < LCD_CGRAM_SLOTS; s++)
+        lcd->slot[s].id = -1;
+}
+
+/* Give every glyph in the framebuffer snapshot a CGRAM slot and put the
+slot's character code in its cells. A glyph keeps its slot for as long as
+it is on screen. One that has no slot takes the slot shown least recently
+that this frame does not need, and only then are its rows uploaded, so
+redrawing a gauge from the same few glyphs sends no CGRAM traffic at all.
+The slots belong to the engine; lock is only held to copy out the cells'
+glyphs and then the rows of the glyphs to upload. */
+static void lcd_plan_glyphs(struct lcd_data *lcd, struct lcd_vc *vc, char *fb){
+    unsigned int i, r, n = lcd->rows * lcd->cols;
+    unsigned int gen[LCD_GLYPH_MAX];
+    u8 tag[LCD_MAX_CELLS], rows[LCD_CGRAM_SLOTS][8];
+    s8 slot_of[LCD_GLYPH_MAX];
+    struct lcd_glyph_slot *sl;
+    u8 upload = 0;
+    u64 want = 0;
+    int id, s, best;
+
+    spin_lock(&lcd->lock);
+    memcpy(tag, vc->glyph_at, n);
+    for (i = 0; i < LCD_GLYPH_MAX; i++)
+        gen[i] = lcd->glyphs[i].gen;
+    spin_unlock(&lcd->lock);
+    for (i = 0; i < n; i++) {
+        if (fb[i] == LCD_GLYPH_CELL && tag[i])
+            want |= BIT_ULL(tag[i] - 1);
+    }
+    if (!want)
+        return;
+
+    lcd->glyph_clock++;
+    memset(slot_of, -1, sizeof(slot_of));
+    for (s = 0; s < LCD_CGRAM_SLOTS; s++) {
+        sl = &lcd->slot[s];
+        if (sl->id >= 0 && want & BIT_ULL(sl->id)) {
+            slot_of[sl->id] = s;
+            sl->used = lcd->glyph_clock;
+        }
+    }
+    for (id = 0; id < LCD_GLYPH_MAX; id++) {
+        if (!(want & BIT_ULL(id)))
+            continue;
+        s = slot_of[id];
+        if (s < 0) {
+            best = -1;
+            for (s = 0; s < LCD_CGRAM_SLOTS; s++) {
+                if (lcd->slot[s].used != lcd->glyph_clock &&
+                    (best < 0 || lcd->slot[s].used < lcd->slot[best].used))
+                    best = s;
+            }
+            // more glyphs on screen than slots; the rest show blank
+            if (best < 0)
+                continue;
+            s = best;
+            slot_of[id] = s;
+            lcd->slot[s].id = id;
+            lcd->slot[s].gen = 0;
+            lcd->slot[s].used = lcd->glyph_clock;
+        }
+        if (lcd->slot[s].gen != gen[id])
+            upload |= BIT(s);
+    }
+
+    if (upload) {
+        spin_lock(&lcd->lock);
+        for (s = 0; s < LCD_CGRAM_SLOTS; s++) {
+            if (upload & BIT(s)) {
+                id = lcd->slot[s].id;
+                memcpy(rows[s], lcd->glyphs[id].rows, 8);
+                lcd->slot[s].gen = lcd->glyphs[id].gen;
+            }
+        }
+        spin_unlock(&lcd->lock);
+    }
+    for (s = 0; s < LCD_CGRAM_SLOTS; s++) {
+        if (!(upload & BIT(s)))
+            continue;
+        lcd_plan_op(lcd, LCD_CGRAM | s << 3, 0, LCD_TAG_SLOT(s));
+        for (r = 0; r < 8; r++)
+            lcd_plan_op(lcd, rows[s][r], 1, LCD_TAG_SLOT(s));
+        lcd->ac = LCD_AC_CGRAM;
+    }
+    for (i = 0; i < n; i++) {
+        if (fb[i] == LCD_GLYPH_CELL && tag[i]) {
+            s = slot_of[tag[i] - 1];
+            fb[i] = s >= 0 ? s : ' ';
+        }
+    }
+}
+
+/* Work out what the next flush has to send: the cells of the framebuffer
+that differ from what the LCD is showing. The LCD auto-increments its
+address counter after every character (see LCD_ENTRY), so a run of
+adjacent changed cells only needs one Set DDRAM Address instruction. The
+framebuffer is snapshotted so a cell that changes mid-flush is sent whole
+on the next one. The LCD state is moved on as if the plan had been sent. */
+static void lcd_plan(struct lcd_data *lcd){
+    int order[LCD_MAX_ROWS], n = lcd->rows * lcd->cols;
+    int r, c, i, k, p, start, sent = 0;
+    struct lcd_vc *vc = &lcd->vc[ACCESS_ONCE(lcd->fg)];
+    char fb[LCD_MAX_CELLS];
+    uint8_t addr;
+
+    // pairs with lcd_ioctl_sync()
+    lcd->frame_gen++;
+    smp_mb();
+    memcpy(fb, vc->fb, n);
+    lcd->plan_len = 0;
+
+    // undo whatever raw instructions did to the addressing
+    if (lcd->shifted) {
+        lcd_plan_op(lcd, LCD_HOME, 0, LCD_TAG_NONE);
+        lcd->ac = 0;
+        lcd->shifted = false;
+        lcd->resync = true;
+    }
+    if (lcd->entry != LCD_ENTRY) {
+        lcd_plan_op(lcd, LCD_ENTRY, 0, LCD_TAG_NONE);
+        lcd->entry = LCD_ENTRY;
+    }
+    lcd_plan_glyphs(lcd, vc, fb);
+
+    /* Cells are visited in DDRAM order rather than row by row, starting
+    from wherever the address counter was left: on a 4-row panel rows 3
+    and 4 continue rows 1 and 2, and line 1 wraps into line 2 at 0x27, so
+    a change running on across those needs no address of its own either. */
+    for (r = 0; r < lcd->rows; r++) {
+        for (k = r; k > 0 && lcd->row_addr[order[k - 1]] > lcd->row_addr[r]; k--)
+            order[k] = order[k - 1];
+        order[k] = r;
+    }
+    start = 0;
+    i = lcd->ac >= 0 ? lcd_addr_cell(lcd, lcd->ac) : -1;
+    if (i >= 0) {
+        for (k = 0; order[k] != i / lcd->cols; k++)
+            ;
+        start = k * lcd->cols + i % lcd->cols;
+    }
+
+    for (k = 0; k < n; k++) {
+        p = (start + k) % n;
+        r = order[p / lcd->cols];
+        c = p % lcd->cols;
+        i = r * lcd->cols + c;
+        if (fb[i] == lcd->shown[i] && !lcd->resync && !test_bit(i, lcd->stale))
+            continue;
+        addr = lcd->row_addr[r] + c;
+        if (lcd->ac != addr)
+            lcd_plan_op(lcd, LCD_DDRAM | addr, 0, LCD_TAG_NONE);
+        lcd_plan_op(lcd, fb[i], 1, i);
+        lcd->shown[i] = fb[i];
+        __clear_bit(i, lcd->stale);
+        lcd->ac = lcd_ac_next(lcd, addr);
+        sent++;
+    }
+    lcd->resync = false;
+    lcd->stats.skipped += n - sent;
+    trace_lcd_flush(lcd->minor, lcd->plan_len, sent, n - sent);
+}
+
+static bool lcd_urgent(struct lcd_data *lcd){
+    return !kfifo_is_empty(&lcd->urgq);
+}
+
+/* Send everything on the priority lane, ahead of whatever the engine was
+in the middle of. */
+static void lcd_run_urgent(struct lcd_data *lcd){
+    struct lcd_op op;
+
+    while (kfifo_get(&lcd->urgq, &op)) {
+        trace_lcd_dequeue(lcd->minor, 1, true);
+        lcd_write(lcd, op.val, op.rs);
+        lcd_track(lcd, op.val, op.rs);
+    }
+    lcd_bus_flush(lcd);
+    wake_up_interruptible(&lcd->waitq);
+}
+
+/* Drop the rest of a plan from op k on, for an urgent batch to go out
+first, and have the next flush send what was left out. What the plan
+already sent stays sent. */
+static void lcd_plan_abort(struct lcd_data *lcd, unsigned int k){
+    struct lcd_op *op;
+    int tag;
+
+    for (; k < lcd->plan_len; k++) {
+        op = &lcd->plan[k];
+        tag = lcd->plan_tag[k];
+        if (tag >= 0)
+            __set_bit(tag, lcd->stale);
+        else if (tag != LCD_TAG_NONE)
+            lcd->slot[LCD_TAG_SLOT(0) - tag].gen = 0;
+        else if (!op->rs && op->val == LCD_HOME)
+            lcd->shifted = true;
+        else if (!op->rs && op->val == LCD_ENTRY)
+            lcd->entry = 0;
+    }
+    lcd->plan_len = 0;
+    lcd->ac = LCD_AC_UNKNOWN;
+}
+
+/* Keep the panel out of runtime suspend while the engine drives it, and
+turn the display back on if it was put to sleep, with the cursor and blink
+as they were. A display that userspace had switched off stays off. Every
+engine pass that has something to send brackets it with lcd_wake() and
+lcd_idle(). */
+static void lcd_wake(struct lcd_data *lcd){
+    pm_runtime_get_sync(lcd->parent);
+    if (lcd->asleep) {
+        if (lcd->display & 0x04)
+            lcd_write(lcd, lcd->display, 0);
+        lcd->asleep = false;
+    }
+}
+
+// Start the idle period over
+static void lcd_idle(struct lcd_data *lcd){
+    pm_runtime_mark_last_busy(lcd->parent);
+    pm_runtime_put_autosuspend(lcd->parent);
+}
+
+/* The plan has gone out whole, so its framebuffer is on the LCD. Only a
+plan that sent something counts as a frame, but an empty one still moves
+frame_done on for lcd_ioctl_sync(). */
+static void lcd_frame_done(struct lcd_data *lcd){
+    if (lcd->plan_len)
+        lcd->stats.frames++;
+    ACCESS_ONCE(lcd->frame_done) = lcd->frame_gen;
+    wake_up_interruptible(&lcd->waitq);
+}
+
+/* Send whatever the framebuffer changed by on one panel, unless an urgent
+batch comes in first. A flush with nothing to send neither wakes the
+panel nor counts as activity, so periodic flushes of an unchanged
+framebuffer let it go idle. */
+static void lcd_flush(struct lcd_data *lcd){
+    unsigned int i;
+    bool busy;
+
+    lcd_plan(lcd);
+    busy = lcd->plan_len;
+    if (busy)
+        lcd_wake(lcd);
+    for (i = 0; i < lcd->plan_len; i++) {
+        if (lcd_urgent(lcd)) {
+            lcd_plan_abort(lcd, i);
+            lcd_run_urgent(lcd);
+            lcd_schedule_flush(lcd, false);
+            lcd_idle(lcd);
+            return;
+        }
+        lcd_write(lcd, lcd->plan[i].val, lcd->plan[i].rs);
+    }
+    lcd_bus_flush(lcd);
+    lcd_frame_done(lcd);
+    if (busy)
+        lcd_idle(lcd);
+}
+
+/* Send the plans of several panels on shared data lines together. Each
+round puts the next byte of every plan on the bus, and panels whose next
+byte is the same get it from one data setup and a single strobe of all
+their E lines. Then the round waits out one execution time, which covers
+every panel strobed in it, so N panels take little more time than one.
+Panels of different controllers wait for the slowest of them. */
+static void lcd_group_send(struct lcd_data **p, unsigned int n){
+    struct lcd_data *same[LCD_MAX_DEVS];
+    struct lcd_op *op;
+    unsigned int k, i, j, m;
+    unsigned int us;
+    bool more = true;
+    ktime_t start;
+    u32 sent;
+    s64 ns;
+
+    for (k = 0; more; k++) {
+        // one urgent batch cuts the whole group's flush short
+        for (i = 0; i < n && !lcd_urgent(p[i]); i++)
+            ;
+        if (i < n) {
+            for (i = 0; i < n; i++) {
+                lcd_plan_abort(p[i], k);
+                lcd_run_urgent(p[i]);
+                lcd_schedule_flush(p[i], false);
+            }
+            return;
+        }
+        more = false;
+        us = 0;
+        sent = 0;
+        for (i = 0; i < n; i++) {
+            if (k >= p[i]->plan_len || sent & BIT(i))
+                continue;
+            op = &p[i]->plan[k];
+            for (j = i, m = 0; j < n; j++) {
+                if (sent & BIT(j) || k >= p[j]->plan_len || p[j]->ops != p[i]->ops ||
+                    p[j]->plan[k].rs != op->rs || p[j]->plan[k].val != op->val)
+                    continue;
+                same[m++] = p[j];
+                sent |= BIT(j);
+            }
+            trace_lcd_xmit(p[i]->minor, op->val, op->rs, m);
+            p[i]->ops->send_shared(same, m, op->val, op->rs);
+            for (j = 0; j < m; j++) {
+                same[j]->stats.bytes++;
+                us = max(us, lcd_exec_us(same[j], op->val, op->rs));
+            }
+            more = true;
+        }
+        if (more) {
+            start = ktime_get();
+            lcd_pause(p[0], us);
+            ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+            for (i = 0; i < n; i++)
+                p[i]->stats.wait_ns += ns;
+        }
+    }
+    for (i = 0; i < n; i++)
+        lcd_frame_done(p[i]);
+}
+
+/* Flush every ready panel on a group of shared data lines at once. A
+panel's own flush work then finds nothing left to send. Only the group's
+own lock is held across the transfer, so other groups and probes do not
+wait for it. */
+static void lcd_group_flush(struct lcd_group *grp){
+    struct lcd_data *p[LCD_MAX_DEVS], *lcd;
+    unsigned int n = 0;
+    u32 busy = 0;
+
+    mutex_lock(&grp->lock);
+    list_for_each_entry(lcd, &grp->panels, group_node) {
+        if (!lcd->ready || lcd->dying || lcd->marquee)
+            continue;
+        lcd->last_flush = jiffies;
+        lcd_plan(lcd);
+        // as in lcd_flush(), only panels with something to send wake up
+        if (lcd->plan_len) {
+            lcd_wake(lcd);
+            busy |= BIT(n);
+        }
+        p[n++] = lcd;
+    }
+    if (n)
+        lcd_group_send(p, n);
+    while (n--) {
+        if (busy & BIT(n))
+            lcd_idle(p[n]);
+    }
+    mutex_unlock(&grp->lock);
+}
+
+// Address the LCD moves on to after a character is written at ac
+static int lcd_ac_next(struct lcd_data *lcd, int ac){
+    // DDRAM wraps from the end of one line to the start of the other
+    if (lcd->rows == 1)
+        return ac == 0x4f ? 0x00 : ac + 1;
+    return ac == 0x27 ? 0x40 : ac == 0x67 ? 0x00 : ac + 1;
+}
+
+// Find the framebuffer cell shown at a DDRAM address, or -1
+static int lcd_addr_cell(struct lcd_data *lcd, int addr){
+    int r;
+
+    for (r = 0; r < lcd->rows; r++) {
+        if (addr >= lcd->row_addr[r] && addr < lcd->row_addr[r] + lcd->cols)
+            return r * lcd->cols + addr - lcd->row_addr[r];
+    }
+    return -1;
+}
+
+/* Follow the effect of a queued instruction or character on the LCD, so
+the next flush starts from what is really on screen. Characters are
+mirrored into fb as well, otherwise the flush would put the old text
+back over them. Only an entry mode that increments without shifting is
+followed cell by cell; characters sent in any other mode leave the next
+flush to home the display and resend every cell. An instruction is told
+apart by its highest set bit. */
+static void lcd_track(struct lcd_data *lcd, uint8_t val, int rs){
+    int i;
+
+    if (rs) {
+        if (lcd->ac == LCD_AC_CGRAM)
+            return;
+        // entry 0 stands for a mode the LCD may or may not have been given
+        if (!lcd->entry || lcd->entry & 0x01)
+            lcd->shifted = true;
+        if (lcd->ac == LCD_AC_UNKNOWN || !(lcd->entry & 0x02)) {
+            lcd->ac = LCD_AC_UNKNOWN;
+            lcd->resync = true;
+            return;
+        }
+        i = lcd_addr_cell(lcd, lcd->ac);
+        if (i >= 0) {
+            lcd->shown[i] = val;
+            lcd->vc[ACCESS_ONCE(lcd->fg)].fb[i] = val;
+        }
+        lcd->ac = lcd_ac_next(lcd, lcd->ac);
+        return;
+    }
+
+    if (val & LCD_DDRAM) {
+        lcd->ac = val & 0x7f;
+    } else if (val & LCD_CGRAM) {
+        // raw CGRAM writes may overwrite any slot
+        lcd->ac = LCD_AC_CGRAM;
+        lcd_forget_glyphs(lcd);
+    } else if (val & 0x20) {
+        // function set leaves the address counter and display alone
+    } else if (val & 0x10) {
+        // cursor or display shift
+        if (val & 0x08)
+            lcd->shifted = true;
+        lcd->ac = LCD_AC_UNKNOWN;
+    } else if (val & 0x08) {
+        // display control only turns the display, cursor and blink on or off
+        lcd->display = val;
+    } else if (val & 0x04) {
+        lcd->entry = val;
+        lcd->ac = LCD_AC_UNKNOWN;
+    } else if (val & 0x02) {
+        lcd->ac = 0;
+        lcd->shifted = false;
+    } else if (val == LCD_CLEAR) {
+        memset(lcd->shown, ' ', sizeof(lcd->shown));
+        memset(lcd->vc[ACCESS_ONCE(lcd->fg)].fb, ' ', lcd->rows * lcd->cols);
+        lcd->ac = 0;
+        lcd->shifted = false;
+        lcd->entry |= 0x02;
+    }
+}
+
+/* Run the priority lane between two batches, then put the entry mode and
+the DDRAM address back where the batches left them, so that the next one
+carries on as if nothing had come in between. A batch that ended in CGRAM
+has to set its own CGRAM address again. */
+static void lcd_run_urgent_between(struct lcd_data *lcd){
+    uint8_t entry = lcd->entry;
+    int ac = lcd->ac;
+
+    lcd_run_urgent(lcd);
+    if (entry && lcd->entry != entry) {
+        lcd_write(lcd, entry, 0);
+        lcd_track(lcd, entry, 0);
+    }
+    if (ac >= 0 && lcd->ac != ac) {
+        lcd_write(lcd, LCD_DDRAM | ac, 0);
+        lcd_track(lcd, LCD_DDRAM | ac, 0);
+    }
+}
+
+/* Send everything queued by LCD_IOC_BATCH, the priority lane first and
+again whenever something turns up on it. Each batch depends on its own
+earlier bytes, such as the address it set, so urgent batches only go in
+where a batch ends. The engine is the only reader of both queues, so it
+needs no lock to take entries out. */
+static void lcd_run_cmds(struct lcd_data *lcd){
+    struct lcd_op ops[LCD_CMD_CHUNK];
+    unsigned int i, n;
+    bool end = true;
+    int rs;
+
+    // cmdq only ever holds whole batches, so it starts at a batch boundary
+    lcd_run_urgent_between(lcd);
+    while ((n = kfifo_out(&lcd->cmdq, ops, LCD_CMD_CHUNK)) > 0) {
+        trace_lcd_dequeue(lcd->minor, n, false);
+        // let blocked or polling producers refill the space just freed
+        wake_up_interruptible(&lcd->waitq);
+        for (i = 0; i < n; i++) {
+            if (end && lcd_urgent(lcd))
+                lcd_run_urgent_between(lcd);
+            rs = ops[i].rs & 1;
+            end = ops[i].rs & LCD_OP_END;
+            lcd_write(lcd, ops[i].val, rs);
+            lcd_track(lcd, ops[i].val, rs);
+        }
+    }
+    lcd_bus_flush(lcd);
+}
+
+/* Transmit engine. Brings the LCD up the first time it runs, then sends
+any queued instructions. Writers that arrive while it is busy simply
+requeue it. */
+static void lcd_work(struct work_struct *work){
+    struct lcd_data *lcd = container_of(work, struct lcd_data, work);
+
+    // the last thing sent to a panel being removed is a clear
+    if (lcd->dying) {
+        if (lcd->ready)
+            lcd_write(lcd, LCD_CLEAR, 0);
+        return;
+    }
+    lcd_wake(lcd);
+    if (!lcd->ready) {
+        lcd_init(lcd);
+        lcd->ready = true;
+        // pick up anything written before the LCD was up, unless remove has begun
+        spin_lock(&lcd->lock);
+        if (!lcd->dying)
+            lcd_schedule_flush(lcd, false);
+        spin_unlock(&lcd->lock);
+    }
+    lcd_run_cmds(lcd);
+    lcd_idle(lcd);
+}
+
+/* Rate-limited half of the engine. It runs on the same ordered workqueue
+as lcd_work(), so the two never drive the bus at once. A panel sharing its
+data lines flushes the whole group. */
+static void lcd_flush_work(struct work_struct *work){
+    struct lcd_data *lcd = container_of(to_delayed_work(work),
+                                        struct lcd_data, flush_work);
+
+    if (!lcd->ready || lcd->marquee)
+        return;
+    if (lcd->group && lcd->group->users > 1 && lcd->ops->send_shared) {
+        lcd_group_flush(lcd->group);
+        return;
+    }
+    lcd->last_flush = jiffies;
+    lcd_flush(lcd);
+}
+
+/* Marquee half of the engine. A new marquee is loaded into display RAM
+from an unshifted display, after which every step is a single display
+shift instruction. Once the marquee stops, the display is still shifted,
+so the next flush returns home and redraws the framebuffer whole. */
+static void lcd_marquee_work(struct work_struct *work){
+    struct lcd_data *lcd = container_of(to_delayed_work(work),
+                                        struct lcd_data, mq_work);
+    u8 text[2][LCD_LINE_LEN];
+    unsigned int period, gen, line, i;
+
+    // a marquee set before lcd_init() waits for it
+    if (!lcd->ready) {
+        queue_delayed_work(lcd->wq, &lcd->mq_work, 1);
+        return;
+    }
+    spin_lock(&lcd->lock);
+    period = lcd->mq_period;
+    gen = lcd->mq_gen;
+    memcpy(text, lcd->mq_text, sizeof(text));
+    spin_unlock(&lcd->lock);
+
+    if (!period) {
+        if (lcd->marquee) {
+            lcd->marquee = false;
+            lcd_schedule_flush(lcd, false);
+        }
+        return;
+    }
+    lcd_wake(lcd);
+    if (gen != lcd->mq_loaded) {
+        lcd_write(lcd, LCD_HOME, 0);
+        lcd_write(lcd, LCD_ENTRY, 0);
+        // a one-line controller takes both halves as one 80-character line
+        for (line = 0; line < 2; line++) {
+            lcd_write(lcd, LCD_DDRAM | (lcd->rows == 1 ? LCD_LINE_LEN : 0x40) * line, 0);
+            for (i = 0; i < LCD_LINE_LEN; i++)
+                lcd_write(lcd, text[line][i], 1);
+        }
+        lcd->entry = LCD_ENTRY;
+        lcd->ac = LCD_AC_UNKNOWN;
+        lcd->shifted = true;
+        lcd->mq_loaded = gen;
+        lcd->marquee = true;
+    } else {
+        lcd_write(lcd, LCD_SHIFT_LEFT, 0);
+    }
+    lcd_bus_flush(lcd);
+    lcd_idle(lcd);
+    queue_delayed_work(lcd->wq, &lcd->mq_work, msecs_to_jiffies(period));
+}
+
+// Show the next console that has a file on it, every vc_rotate_ms
+static void lcd_vc_work(struct work_struct *work){
+    struct lcd_data *lcd = container_of(to_delayed_work(work),
+                                        struct lcd_data, vc_work);
+    unsigned int i, n;
+
+    spin_lock(&lcd->lock);
+    for (i = 1; i < LCD_VC_MAX; i++) {
+        n = (lcd->fg + i) % LCD_VC_MAX;
+        if (lcd->vc[n].users) {
+            lcd->fg = n;
+            lcd_schedule_flush(lcd, false);
+            break;
+        }
+    }
+    spin_unlock(&lcd->lock);
+    queue_delayed_work(lcd->wq, &lcd->vc_work, msecs_to_jiffies(vc_rotate_ms));
+}
+
+/* Put the display to sleep on behalf of lcd_runtime_suspend(). Anything
+the engine gets to after it resumes the panel first, so a panel that is
+active again by now is left alone. */
+static void lcd_sleep_work(struct work_struct *work){
+    struct lcd_data *lcd = container_of(work, struct lcd_data, sleep_work);
+
+    if (!lcd->ready || lcd->asleep || lcd->dying || !pm_runtime_suspended(lcd->parent))
+        return;
+    lcd_write(lcd, LCD_DISPLAYOFF, 0);
+    if (lcd->ops->park)
+        lcd->ops->park(lcd);
+    lcd_bus_flush(lcd);
+    lcd->asleep = true;
+}
+
+// Find the group already on the panel's RS and data lines, or NULL
+static struct lcd_group *lcd_find_group(struct lcd_data *lcd){
+    struct lcd_group *grp;
+    unsigned int first = lcd->bus8 ? 0 : 4;
+
+    list_for_each_entry(grp, &lcd_groups, node) {
+        if (grp->bus8 == lcd->bus8 && grp->gpio_rs == lcd->gpio_rs &&
+            !memcmp(&grp->gpio_db[first], &lcd->gpio_db[first],
+                    (8 - first) * sizeof(grp->gpio_db[0])))
+            return grp;
+    }
+    return NULL;
+}
+
+// Free the pins shared by a group's panels
+static void free_group_gpio(struct lcd_group *grp){
+    unsigned int i;
+
+    gpio_free(grp->gpio_rs);
+    gpio_free(grp->gpio_rw);
+    for (i = grp->bus8 ? 0 : 4; i < 8; i++)
+        gpio_free(grp->gpio_db[i]);
+}
+
+/* Start a group on the panel's data lines, taking the shared pins and
+setting up its workqueue. */
+static struct lcd_group *lcd_new_group(struct lcd_data *lcd){
+    /* GPIO pins are requested in the kernel with gpio_request. Labels
+    are assigned as parameters. */
+    struct lcd_group *grp;
+    unsigned int i;
+
+    grp = kzalloc(sizeof(*grp), GFP_KERNEL);
+    if (!grp)
+        return NULL;
+    grp->gpio_rs = lcd->gpio_rs;
+    grp->gpio_rw = lcd->gpio_rw;
+    memcpy(grp->gpio_db, lcd->gpio_db, sizeof(grp->gpio_db));
+    grp->bus8 = lcd->bus8;
+    mutex_init(&grp->lock);
+    INIT_LIST_HEAD(&grp->panels);
+
+    // all the pins start out as outputs driven low
+    if (gpio_request_one(grp->gpio_rs, GPIOF_OUT_INIT_LOW, "RS")) {
+        printk("GPIO request failure: %s\n", "RS");
+        goto err;
+    }
+    if (gpio_request_one(grp->gpio_rw, GPIOF_OUT_INIT_LOW, "RW")) {
+        printk("GPIO request failure: %s\n", "RW");
+        gpio_free(grp->gpio_rs);
+        goto err;
+    }
+    for (i = grp->bus8 ? 0 : 4; i < 8; i++) {
+        if (gpio_request_one(grp->gpio_db[i], GPIOF_OUT_INIT_LOW, db_label[i])) {
+            printk("GPIO request failure: %s\n", db_label[i]);
+            while (i-- > (grp->bus8 ? 0 : 4))
+                gpio_free(grp->gpio_db[i]);
+            gpio_free(grp->gpio_rw);
+            gpio_free(grp->gpio_rs);
+            goto err;
+        }
+    }
+
+    grp->wq = alloc_ordered_workqueue("lcd%d", 0, lcd->minor);
+    if (!grp->wq) {
+        free_group_gpio(grp);
+        goto err;
+    }
+    list_add(&grp->node, &lcd_groups);
+    return grp;
+
+err:
+    kfree(grp);
+    return NULL;
+}
+
+/* Request GPIO pins at probe; they are held until the panel is removed.
+A panel whose data lines are already in use by a group joins it and only
+takes its own E line, which is device-managed. Returns 0 on success, a
+negative number on failure. */
+static int req_gpio(struct lcd_data *lcd){
+    struct lcd_group *grp;
+    int ret = -1;
+
+    mutex_lock(&lcd_group_mutex);
+    grp = lcd_find_group(lcd);
+    if (grp && grp->gpio_rw != lcd->gpio_rw) {
+        printk(KERN_NOTICE "LCDs on shared data lines need a shared RW\n");
+        goto out;
+    }
+    if (!grp && !(grp = lcd_new_group(lcd)))
+        goto out;
+    if (devm_gpio_request_one(lcd->parent, lcd->gpio_e, GPIOF_OUT_INIT_LOW, "E")) {
+        printk("GPIO request failure: %s\n", "E");
+        if (!grp->users) {
+            list_del(&grp->node);
+            destroy_workqueue(grp->wq);
+            free_group_gpio(grp);
+            kfree(grp);
+        }
+        goto out;
+    }
+    grp->users++;
+    mutex_lock(&grp->lock);
+    list_add_tail(&lcd->group_node, &grp->panels);
+    mutex_unlock(&grp->lock);
+    lcd->group = grp;
+    lcd->wq = grp->wq;
+    ret = 0;
+out:
+    mutex_unlock(&lcd_group_mutex);
+    return ret;
+}
+
+/* Leave the group joined by req_gpio(). The E line goes with the panel's
+device; the last panel to leave a group takes the shared pins and the
+workqueue with it. */
+static void free_gpio(struct lcd_data *lcd){
+    struct lcd_group *grp = lcd->group;
+
+    mutex_lock(&lcd_group_mutex);
+    mutex_lock(&grp->lock);
+    list_del(&lcd->group_node);
+    mutex_unlock(&grp->lock);
+    if (--grp->users == 0) {
+        list_del(&grp->node);
+        destroy_workqueue(grp->wq);
+        free_group_gpio(grp);
+        kfree(grp);
+    }
+    mutex_unlock(&lcd_group_mutex);
+}
+
+static const struct lcd_bus_ops lcd_gpio_ops = {
+    .name = "gpio",
+    .attach = req_gpio,
+    .detach = free_gpio,
+    .send_nibble = lcd_gpio_strobe,
+    .send_byte = lcd_gpio_byte,
+    .read_mode = lcd_gpio_read_mode,
+    .read_busy = lcd_gpio_read_busy,
+    .read_addr = lcd_gpio_read_addr,
+    .park = lcd_gpio_park,
+    .send_shared = lcd_gpio_shared,
+};
+
+/* Build the register masks for every nibble value on the panel's data
+lines. Returns false if a pin is outside GPSET0/GPCLR0, i.e. not one of
+GPIO 0-31. */
+static bool lcd_build_masks(struct lcd_data *lcd){
+    u32 hi_all = 0, lo_all = 0, hi, lo;
+    unsigned int n, i;
+
+    if (lcd->gpio_rs > 31 || lcd->gpio_e > 31)
+        return false;
+    for (i = lcd->bus8 ? 0 : 4; i < 8; i++) {
+        if (lcd->gpio_db[i] > 31)
+            return false;
+    }
+    for (i = 0; i < 4; i++) {
+        hi_all |= BIT(lcd->gpio_db[4 + i]);
+        lo_all |= lcd->bus8 ? BIT(lcd->gpio_db[i]) : 0;
+    }
+    for (n = 0; n < 16; n++) {
+        hi = lo = 0;
+        for (i = 0; i < 4; i++) {
+            if (n & BIT(i)) {
+                hi |= BIT(lcd->gpio_db[4 + i]);
+                lo |= lcd->bus8 ? BIT(lcd->gpio_db[i]) : 0;
+            }
+        }
+        lcd->nib_mask[n].set = hi;
+        lcd->nib_mask[n].clr = hi_all & ~hi;
+        lcd->low_mask[n].set = lo;
+        lcd->low_mask[n].clr = lo_all & ~lo;
+    }
+    return true;
+}
+
+// Take the pins as for gpiolib, then map the GPIO registers
+static int lcd_mmio_attach(struct lcd_data *lcd){
+    if (req_gpio(lcd) < 0)
+        return -1;
+    if (!lcd_build_masks(lcd)) {
+        printk(KERN_NOTICE "LCD pins beyond GPIO 31, using gpiolib\n");
+        lcd->ops = &lcd_gpio_ops;
+        return 0;
+    }
+    lcd->gpio_base = ioremap(GPIO_BASE, SZ_4K);
+    if (!lcd->gpio_base) {
+        printk(KERN_WARNING "Cannot map GPIO registers, using gpiolib\n");
+        lcd->ops = &lcd_gpio_ops;
+    }
+    return 0;
+}
+
+static void lcd_mmio_detach(struct lcd_data *lcd){
+    iounmap(lcd->gpio_base);
+    free_gpio(lcd);
+}
+
+static const struct lcd_bus_ops lcd_mmio_ops = {
+    .name = "mmio",
+    .attach = lcd_mmio_attach,
+    .detach = lcd_mmio_detach,
+    .send_nibble = lcd_mmio_strobe,
+    .send_byte = lcd_mmio_byte,
+    .read_mode = lcd_gpio_read_mode,
+    .read_busy = lcd_mmio_read_busy,
+    .read_addr = lcd_gpio_read_addr,
+    .park = lcd_mmio_park,
+    .send_shared = lcd_mmio_shared,
+};
+
+// Attach to the panel's PCF8574 backpack
+static int req_i2c(struct lcd_data *lcd){
+    struct i2c_adapter *adap;
+
+    adap = i2c_get_adapter(lcd->i2c_bus);
+    if (!adap) {
+        printk(KERN_NOTICE "No I2C bus %d\n", lcd->i2c_bus);
+        return -1;
+    }
+    lcd->i2c = i2c_new_dummy(adap, lcd->i2c_addr);
+    i2c_put_adapter(adap);
+    if (!lcd->i2c) {
+        printk(KERN_NOTICE "Cannot use I2C address 0x%02x\n", lcd->i2c_addr);
+        return -1;
+    }
+    return 0;
+}
+
+static void lcd_i2c_detach(struct lcd_data *lcd){
+    i2c_unregister_device(lcd->i2c);
+}
+
+// RW is tied low on the backpack side, so the busy flag cannot be read
+static const struct lcd_bus_ops lcd_i2c_ops = {
+    .name = "i2c",
+    .attach = req_i2c,
+    .detach = lcd_i2c_detach,
+    .send_nibble = lcd_i2c_strobe,
+    .send_byte = lcd_i2c_byte,
+    .delay = lcd_i2c_delay,
+    .batch_flush = lcd_i2c_flush,
+    .park = lcd_i2c_park,
+};
+
+/* Read a panel's wiring from its device tree node. Properties that are
+left out take the defaults of the module parameters. data-gpios lists
+DB4-DB7 for a 4-bit bus and DB0-DB7 for an 8-bit one; a panel with
+i2c-bus set is on a PCF8574 backpack and has no GPIO pins. */
+static int lcd_parse_dt(struct device *dev, struct lcd_platform_data *pd){
+    struct device_node *np = dev->of_node;
+    unsigned int i, first;
+    u32 val;
+    int gpio;
+
+    memset(pd, 0, sizeof(*pd));
+    pd->rows = 2;
+    pd->cols = 16;
+    pd->bus_width = 4;
+    pd->i2c_bus = -1;
+    pd->i2c_addr = 0x27;
+    if (!of_property_read_u32(np, "rows", &val))
+        pd->rows = val;
+    if (!of_property_read_u32(np, "columns", &val))
+        pd->cols = val;
+    if (!of_property_read_u32(np, "bus-width", &val))
+        pd->bus_width = val;
+    of_property_read_string(np, "timing", &pd->timing);
+    if (!of_property_read_u32(np, "i2c-bus", &val)) {
+        pd->i2c_bus = val;
+        if (!of_property_read_u32(np, "i2c-address", &val))
+            pd->i2c_addr = val;
+        return 0;
+    }
+
+    if ((gpio = of_get_named_gpio(np, "rs-gpios", 0)) < 0)
+        return gpio;
+    pd->gpio_rs = gpio;
+    if ((gpio = of_get_named_gpio(np, "rw-gpios", 0)) < 0)
+        return gpio;
+    pd->gpio_rw = gpio;
+    if ((gpio = of_get_named_gpio(np, "e-gpios", 0)) < 0)
+        return gpio;
+    pd->gpio_e = gpio;
+    first = pd->bus_width == 8 ? 0 : 4;
+    for (i = first; i < 8; i++) {
+        if ((gpio = of_get_named_gpio(np, "data-gpios", i - first)) < 0)
+            return gpio;
+        pd->gpio_db[i] = gpio;
+    }
+    return 0;
+}
+
+static const struct lcd_timing *lcd_find_timing(const char *name){
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(lcd_timings); i++) {
+        if (sysfs_streq(name, lcd_timings[i].name))
+            return &lcd_timings[i];
+    }
+    return NULL;
+}
+
+// The profiles, the panel's own in brackets
+static ssize_t timing_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct lcd_data *lcd = dev_get_drvdata(dev);
+    const struct lcd_timing *cur = ACCESS_ONCE(lcd->timing);
+    unsigned int i;
+    ssize_t n = 0;
+
+    for (i = 0; i < ARRAY_SIZE(lcd_timings); i++)
+        n += sprintf(buf + n, &lcd_timings[i] == cur ? "[%s] " : "%s ",
+                     lcd_timings[i].name);
+    buf[n - 1] = '\n';
+    return n;
+}
+
+// The engine picks the new profile up from the next byte it sends
+static ssize_t timing_store(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count){
+    struct lcd_data *lcd = dev_get_drvdata(dev);
+    const struct lcd_timing *t = lcd_find_timing(buf);
+
+    if (!t)
+        return -EINVAL;
+    ACCESS_ONCE(lcd->timing) = t;
+    return count;
+}
+
+static DEVICE_ATTR_RW(timing);
+
+static struct attribute *lcd_attrs[] = {
+    &dev_attr_timing.attr,
+    NULL,
+};
+
+static const struct attribute_group lcd_attr_group = {
+    .attrs = lcd_attrs,
+};
+
+static const struct attribute_group *lcd_attr_groups[] = {
+    &lcd_attr_group,
+    NULL,
+};
+
+// Busy-flag waits, one line per bucket
+static int lcd_bf_wait_show(struct seq_file *m, void *v){
+    struct lcd_data *lcd = m->private;
+    unsigned int b;
+
+    for (b = 0; b < LCD_BF_BUCKETS; b++) {
+        if (b == LCD_BF_BUCKETS - 1)
+            seq_printf(m, ">=%uus", 10 << (b - 1));
+        else
+            seq_printf(m, "<%uus", 10 << b);
+        seq_printf(m, " %llu\n", (unsigned long long)lcd->stats.bf_wait[b]);
+    }
+    return 0;
+}
+
+static int lcd_bf_wait_open(struct inode *inode, struct file *file){
+    return single_open(file, lcd_bf_wait_show, inode->i_private);
+}
+
+static const struct file_operations lcd_bf_wait_fops = {
+    .owner=THIS_MODULE,
+    .open=lcd_bf_wait_open,
+    .read=seq_read,
+    .llseek=seq_lseek,
+    .release=single_release,
+};
+
+static int lcd_bench_cmp(const void *a, const void *b){
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Time b->runs runs of one test with the current transport and delays
+static void lcd_bench_test(struct lcd_data *lcd, struct lcd_bench *b,
+                           struct lcd_bench_result *res){
+    unsigned int k, r, c, i;
+    u64 total = 0, bytes = 0, chars = 0;
+    ktime_t start;
+
+    for (k = 0; k < b->runs; k++) {
+        start = ktime_get();
+        switch (res->test) {
+        case LCD_BENCH_REDRAW:
+            for (r = 0; r < lcd->rows; r++) {
+                lcd_write(lcd, LCD_DDRAM | lcd->row_addr[r], 0);
+                for (c = 0; c < lcd->cols; c++)
+                    lcd_write(lcd, '0' + (k + c) % 10, 1);
+            }
+            bytes += lcd->rows * (lcd->cols + 1);
+            chars += lcd->rows * lcd->cols;
+            break;
+        case LCD_BENCH_CELL:
+            lcd_write(lcd, LCD_DDRAM | (lcd->row_addr[k % lcd->rows] + k % lcd->cols), 0);
+            lcd_write(lcd, '0' + k % 10, 1);
+            bytes += 2;
+            chars++;
+            break;
+        case LCD_BENCH_CGRAM:
+            lcd_write(lcd, LCD_CGRAM | (k % LCD_CGRAM_SLOTS) * 8, 0);
+            for (i = 0; i < 8; i++)
+                lcd_write(lcd, (k + i) & 0x1f, 1);
+            bytes += 9;
+            chars += 8;
+            break;
+        case LCD_BENCH_CLEAR:
+            lcd_write(lcd, LCD_CLEAR, 0);
+            bytes++;
+            break;
+        }
+        lcd_bus_flush(lcd);
+        b->ns[k] = ktime_to_ns(ktime_sub(ktime_get(), start));
+        total += b->ns[k];
+    }
+    sort(b->ns, b->runs, sizeof(b->ns[0]), lcd_bench_cmp, NULL);
+    total = max_t(u64, total, 1);
+    res->rate = div64_u64(bytes * NSEC_PER_SEC, total);
+    res->char_rate = div64_u64(chars * NSEC_PER_SEC, total);
+    res->p50 = b->ns[b->runs / 2];
+    res->p99 = b->ns[b->runs * 99 / 100];
+}
+
+/* Run every test with fixed delays and, where busy_poll allows it, with
+the busy flag polled, over the panel's transport and, for the register
+transport, over gpiolib on the same pins as well. This holds the engine
+for the whole run, urgent lane included. What the tests leave on the LCD
+is undone by resending every cell. */
+static void lcd_bench_work(struct work_struct *work){
+    struct lcd_bench *b = container_of(work, struct lcd_bench, work);
+    struct lcd_data *lcd = b->lcd;
+    const struct lcd_bus_ops *ops = lcd->ops;
+    const struct lcd_bus_ops *bus[2] = {
+        ops, ops == &lcd_mmio_ops ? &lcd_gpio_ops : NULL
+    };
+    bool bf_ok = lcd->bf_ok;
+    struct lcd_bench_result *res;
+    unsigned int i, bf, t;
+
+    if (!lcd->ready || lcd->marquee) {
+        b->err = -EBUSY;
+        return;
+    }
+    lcd_wake(lcd);
+    for (i = 0; i < 2 && bus[i]; i++) {
+        for (bf = 0; bf <= bf_ok; bf++) {
+            lcd->ops = bus[i];
+            lcd->bf_ok = bf;
+            for (t = 0; t < LCD_BENCH_TESTS; t++) {
+                res = &b->res[b->n++];
+                res->bus = bus[i]->name;
+                res->bf = bf;
+                res->test = t;
+                lcd_bench_test(lcd, b, res);
+            }
+            // a busy flag that got stuck stays off
+            if (bf && !lcd->bf_ok)
+                bf_ok = false;
+        }
+    }
+    lcd->ops = ops;
+    lcd->bf_ok = bf_ok;
+    lcd_forget_glyphs(lcd);
+    lcd->entry |= 0x02;
+    lcd->ac = LCD_AC_UNKNOWN;
+    lcd->resync = true;
+    lcd_schedule_flush(lcd, false);
+    lcd_idle(lcd);
+}
+
+static int lcd_bench_show(struct seq_file *m, void *v){
+    struct lcd_data *lcd = m->private;
+    struct lcd_bench_result *res;
+    unsigned int i;
+
+    mutex_lock(&lcd_bench_mutex);
+    if (lcd->bench) {
+        seq_printf(m, "%u runs each\nbus    delay  test    chars/s  bytes/s  p50_us  p99_us\n",
+                   lcd->bench->runs);
+        for (i = 0; i < lcd->bench->n; i++) {
+            res = &lcd->bench->res[i];
+            seq_printf(m, "%-6s %-6s %-7s %7llu  %7llu %7u %7u\n", res->bus,
+                       res->bf ? "busy" : "fixed", lcd_bench_names[res->test],
+                       (unsigned long long)res->char_rate,
+                       (unsigned long long)res->rate, res->p50 / 1000,
+                       res->p99 / 1000);
+        }
+    }
+    mutex_unlock(&lcd_bench_mutex);
+    return 0;
+}
+
+static int lcd_bench_open(struct inode *inode, struct file *file){
+    return single_open(file, lcd_bench_show, inode->i_private);
+}
+
+/* Any write runs the benchmark and returns once it is done; a number
+written sets how many runs each test gets. */
+static ssize_t lcd_bench_write(struct file *file, const char __user *buf,
+                               size_t len, loff_t *ppos){
+    struct lcd_data *lcd = ((struct seq_file *)file->private_data)->private;
+    struct lcd_bench *b;
+    unsigned int runs;
+    int ret;
+
+    if (kstrtouint_from_user(buf, len, 0, &runs))
+        runs = LCD_BENCH_RUNS;
+    if (!runs || runs > LCD_BENCH_MAX)
+        return -EINVAL;
+    b = kzalloc(sizeof(*b), GFP_KERNEL);
+    if (!b)
+        return -ENOMEM;
+    INIT_WORK(&b->work, lcd_bench_work);
+    b->lcd = lcd;
+    b->runs = runs;
+
+    mutex_lock(&lcd_bench_mutex);
+    queue_work(lcd->wq, &b->work);
+    flush_work(&b->work);
+    ret = b->err;
+    if (ret) {
+        kfree(b);
+    } else {
+        kfree(lcd->bench);
+        lcd->bench = b;
+    }
+    mutex_unlock(&lcd_bench_mutex);
+    return ret ? ret : len;
+}
+
+static const struct file_operations lcd_bench_fops = {
+    .owner=THIS_MODULE,
+    .open=lcd_bench_open,
+    .read=seq_read,
+    .write=lcd_bench_write,
+    .llseek=seq_lseek,
+    .release=single_release,
+};
+
+/* Statistics of one panel, in a debugfs directory named after its node.
+debugfs is only a debugging aid, so failures here are not errors. */
+static void lcd_debugfs_add(struct lcd_data *lcd){
+    struct dentry *dir;
+
+    dir = debugfs_create_dir(dev_name(lcd->dev), lcd_debugfs);
+    if (IS_ERR_OR_NULL(dir))
+        return;
+    lcd->debugfs = dir;
+    debugfs_create_u64("bytes_sent", S_IRUGO, dir, &lcd->stats.bytes);
+    debugfs_create_u64("frames", S_IRUGO, dir, &lcd->stats.frames);
+    debugfs_create_atomic_t("coalesced", S_IRUGO, dir, &lcd->stats.coalesced);
+    debugfs_create_u64("cells_skipped", S_IRUGO, dir, &lcd->stats.skipped);
+    debugfs_create_u32("queue_hwm", S_IRUGO, dir, &lcd->stats.hwm);
+    debugfs_create_u64("wait_ns", S_IRUGO, dir, &lcd->stats.wait_ns);
+    debugfs_create_file("bf_wait", S_IRUGO, dir, lcd, &lcd_bf_wait_fops);
+    debugfs_create_file("bench", S_IRUGO | S_IWUSR, dir, lcd, &lcd_bench_fops);
+}
+
+/* Bring up one panel: check its wiring, set up its framebuffer, queue and
+transmit engine, attach its transport and give it a minor. */
+static int lcd_probe(struct platform_device *pdev){
+    struct lcd_platform_data pd, *pdata = dev_get_platdata(&pdev->dev);
+    struct lcd_data *lcd;
+    char name[8];
+    int i, ret;
+
+    if (pdata) {
+        pd = *pdata;
+    } else if (pdev->dev.of_node) {
+        ret = lcd_parse_dt(&pdev->dev, &pd);
+        if (ret)
+            return ret;
+    } else {
+        return -EINVAL;
+    }
+
+    // check the geometry; rows 3 and 4 continue rows 1 and 2 in DDRAM
+    if (!(pd.rows == 1 || pd.rows == 2 || pd.rows == 4) || pd.cols < 1 ||
+        pd.rows * pd.cols > LCD_MAX_CELLS) {
+        dev_notice(&pdev->dev, "Unsupported LCD geometry %dx%d\n", pd.cols, pd.rows);
+        return -EINVAL;
+    }
+    if (pd.bus_width != 4 && pd.bus_width != 8) {
+        dev_notice(&pdev->dev, "Unsupported LCD bus width %d\n", pd.bus_width);
+        return -EINVAL;
+    }
+    // the backpack only wires DB4-DB7
+    if (pd.i2c_bus >= 0 && pd.bus_width == 8) {
+        dev_notice(&pdev->dev, "The I2C backpack has a 4-bit LCD bus\n");
+        return -EINVAL;
+    }
+    if (!pd.timing)
+        pd.timing = timing;
+    if (!lcd_find_timing(pd.timing)) {
+        dev_notice(&pdev->dev, "Unknown LCD timing %s\n", pd.timing);
+        return -EINVAL;
+    }
+
+    lcd = kzalloc(sizeof(*lcd), GFP_KERNEL);
+    if (!lcd)
+        return -ENOMEM;
+    kref_init(&lcd->ref);
+    lcd->parent = &pdev->dev;
+    lcd->bus8 = pd.bus_width == 8;
+    lcd->timing = lcd_find_timing(pd.timing);
+    lcd->rows = pd.rows;
+    lcd->cols = pd.cols;
+    lcd->row_addr[0] = 0x00;
+    lcd->row_addr[1] = 0x40;
+    lcd->row_addr[2] = pd.cols;
+    lcd->row_addr[3] = 0x40 + pd.cols;
+    lcd->gpio_rs = pd.gpio_rs;
+    lcd->gpio_rw = pd.gpio_rw;
+    lcd->gpio_e = pd.gpio_e;
+    memcpy(lcd->gpio_db, pd.gpio_db, sizeof(lcd->gpio_db));
+    lcd->i2c_bus = pd.i2c_bus;
+    lcd->i2c_addr = pd.i2c_addr;
+
+    // initialize the spinlock, framebuffer and transmit engine
+    spin_lock_init(&(lcd->lock));
+    spin_lock_init(&lcd->qlock);
+    INIT_KFIFO(lcd->cmdq);
+    INIT_KFIFO(lcd->urgq);
+    init_waitqueue_head(&lcd->waitq);
+    for (i = 0; i < LCD_VC_MAX; i++) {
+        lcd->vc[i].fb = (char *)get_zeroed_page(GFP_KERNEL);
+        if (!lcd->vc[i].fb) {
+            ret = -ENOMEM;
+            goto err_fb;
+        }
+        memset(lcd->vc[i].fb, ' ', lcd->rows * lcd->cols);
+    }
+    atomic_set(&lcd->mapped, 0);
+    INIT_WORK(&lcd->work, lcd_work);
+    INIT_DELAYED_WORK(&lcd->flush_work, lcd_flush_work);
+    INIT_DELAYED_WORK(&lcd->refresh, lcd_refresh);
+    INIT_DELAYED_WORK(&lcd->mq_work, lcd_marquee_work);
+    INIT_DELAYED_WORK(&lcd->vc_work, lcd_vc_work);
+    INIT_WORK(&lcd->sleep_work, lcd_sleep_work);
+    lcd->max_fps = min(max_fps, (unsigned int)LCD_MAX_FPS_LIMIT);
+    lcd->last_flush = jiffies;
+
+    ret = lcd->minor = ida_simple_get(&lcd_ida, 0, LCD_MAX_DEVS, GFP_KERNEL);
+    if (ret < 0)
+        goto err_fb;
+
+    // request gpio pins or the I2C backpack
+    if (pd.i2c_bus >= 0)
+        lcd->ops = &lcd_i2c_ops;
+    else if (fast_gpio)
+        lcd->ops = &lcd_mmio_ops;
+    else
+        lcd->ops = &lcd_gpio_ops;
+    if (lcd->ops->attach(lcd) < 0) {
+        ret = -ENODEV;
+        goto err_minor;
+    }
+    // a group brings its workqueue, a panel of its own needs one
+    if (!lcd->group) {
+        lcd->wq = alloc_ordered_workqueue("lcd%d", 0, lcd->minor);
+        if (!lcd->wq) {
+            ret = -ENOMEM;
+            goto err_bus;
+        }
+    }
+
+    // the first panel keeps the old /dev/lcd name
+    lcd->cdev = cdev_alloc();
+    if (!lcd->cdev) {
+        ret = -ENOMEM;
+        goto err_wq;
+    }
+    lcd->cdev->ops = &lcd_fops;
+    lcd->cdev->owner = THIS_MODULE;
+    ret = cdev_add(lcd->cdev, MKDEV(lcd_mjr, lcd->minor), 1);
+    if (ret) {
+        kobject_put(&lcd->cdev->kobj);
+        goto err_wq;
+    }
+    if (lcd->minor)
+        snprintf(name, sizeof(name), "lcd%d", lcd->minor);
+    else
+        strcpy(name, "lcd");
+    lcd->dev = device_create_with_groups(lcd_class, &pdev->dev,
+                                         MKDEV(lcd_mjr, lcd->minor), lcd,
+                                         lcd_attr_groups, "%s", name);
+    if (IS_ERR(lcd->dev)) {
+        ret = PTR_ERR(lcd->dev);
+        goto err_cdev;
+    }
+    platform_set_drvdata(pdev, lcd);
+    spin_lock(&lcd_devs_lock);
+    lcd_devs[lcd->minor] = lcd;
+    spin_unlock(&lcd_devs_lock);
+    lcd_debugfs_add(lcd);
+    if (idle_ms) {
+        pm_runtime_set_autosuspend_delay(&pdev->dev, idle_ms);
+        pm_runtime_use_autosuspend(&pdev->dev);
+        pm_runtime_set_active(&pdev->dev);
+        pm_runtime_enable(&pdev->dev);
+    }
+    dev_info(&pdev->dev, "/dev/%s on the %s transport\n", name, lcd->ops->name);
+
+    /* The engine runs lcd_init() first, in the background, so the node is
+    usable right away: until the LCD is up, write()s and mmap() stores only
+    land in the framebuffer and batches wait in cmdq, and all of it goes
+    out once the engine gets to it. */
+    queue_work(lcd->wq, &lcd->work);
+    if (vc_rotate_ms)
+        queue_delayed_work(lcd->wq, &lcd->vc_work, msecs_to_jiffies(vc_rotate_ms));
+    return 0;
+
+err_cdev:
+    cdev_del(lcd->cdev);
+err_wq:
+    if (!lcd->group)
+        destroy_workqueue(lcd->wq);
+err_bus:
+    lcd->ops->detach(lcd);
+err_minor:
+    ida_simple_remove(&lcd_ida, lcd->minor);
+err_fb:
+    kref_put(&lcd->ref, lcd_free);
+    return ret;
+}
+
+static int lcd_remove(struct platform_device *pdev){
+    struct lcd_data *lcd = platform_get_drvdata(pdev);
+
+    // no new opens from here on, though files already open stay usable
+    spin_lock(&lcd_devs_lock);
+    lcd_devs[lcd->minor] = NULL;
+    spin_unlock(&lcd_devs_lock);
+    debugfs_remove_recursive(lcd->debugfs);
+    kfree(lcd->bench);
+    device_destroy(lcd_class, MKDEV(lcd_mjr, lcd->minor));
+    cdev_del(lcd->cdev);
+    /* Stop the transmit engine, then have it clear the LCD, so that the
+    bus is still only driven from the workqueue if it is shared, and
+    release the bus. */
+    spin_lock(&lcd->lock);
+    spin_lock(&lcd->qlock);
+    lcd->dying = true;
+    spin_unlock(&lcd->qlock);
+    spin_unlock(&lcd->lock);
+    wake_up_interruptible(&lcd->waitq);
+    if (idle_ms) {
+        pm_runtime_disable(&pdev->dev);
+        pm_runtime_dont_use_autosuspend(&pdev->dev);
+    }
+    cancel_work_sync(&lcd->sleep_work);
+    cancel_delayed_work_sync(&lcd->refresh);
+    cancel_delayed_work_sync(&lcd->mq_work);
+    cancel_delayed_work_sync(&lcd->vc_work);
+    cancel_delayed_work_sync(&lcd->flush_work);
+    queue_work(lcd->wq, &lcd->work);
+    flush_work(&lcd->work);
+    // an engine pass that was already running may have queued a flush
+    cancel_delayed_work_sync(&lcd->flush_work);
+    if (!lcd->group)
+        destroy_workqueue(lcd->wq);
+    lcd->ops->detach(lcd);
+    ida_simple_remove(&lcd_ida, lcd->minor);
+    // open files keep the panel's memory until they are closed
+    kref_put(&lcd->ref, lcd_free);
+    return 0;
+}
+
+/* Runtime PM only decides when a panel goes idle: the display itself is
+turned off on the engine, which owns the bus, and turned back on by the
+engine's next pass, so resuming costs nothing here. */
+static int __maybe_unused lcd_runtime_suspend(struct device *dev){
+    struct lcd_data *lcd = dev_get_drvdata(dev);
+
+    queue_work(lcd->wq, &lcd->sleep_work);
+    return 0;
+}
+
+static int __maybe_unused lcd_runtime_resume(struct device *dev){
+    return 0;
+}
+
+static const struct dev_pm_ops lcd_pm_ops = {
+    SET_RUNTIME_PM_OPS(lcd_runtime_suspend, lcd_runtime_resume, NULL)
+};
+
+static const struct of_device_id lcd_of_match[] = {
+    { .compatible = "hit,hd44780-rpi" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, lcd_of_match);
+
+static struct platform_driver lcd_driver = {
+    .probe = lcd_probe,
+    .remove = lcd_remove,
+    .driver = {
+        .name = "rpi-lcd",
+        .owner = THIS_MODULE,
+        .of_match_table = lcd_of_match,
+        .pm = &lcd_pm_ops,
+    },
+};
+
+// Remove the panels created by lcd_add_param_device(), last first
+static void lcd_del_param_device(void){
+    int i;
+
+    for (i = LCD_MAX_DEVS - 1; i >= 0; i--) {
+        if (lcd_param_pdev[i])
+            platform_device_unregister(lcd_param_pdev[i]);
+        lcd_param_pdev[i] = NULL;
+    }
+}
+
+// Create the panels described by the module parameters
+static int lcd_add_param_device(void){
+    struct lcd_platform_data pd = {
+        .rows = rows,
+        .cols = cols,
+        .bus_width = bus_width,
+        .i2c_bus = i2c_bus,
+        .i2c_addr = i2c_addr,
+        .gpio_rs = LCD_GPIO_RS,
+        .gpio_rw = LCD_GPIO_RW,
+        .gpio_e = LCD_GPIO_E,
+    };
+    struct platform_device *pdev;
+    int i;
+
+    memcpy(pd.gpio_db, db_gpio, sizeof(pd.gpio_db));
+    // extra panels share GPIO data lines, which a backpack panel has none of
+    for (i = 0; i <= (i2c_bus >= 0 ? 0 : n_extra_e); i++) {
+        if (i)
+            pd.gpio_e = extra_e[i - 1];
+        pdev = platform_device_register_data(NULL, "rpi-lcd", i, &pd, sizeof(pd));
+        if (IS_ERR(pdev)) {
+            lcd_del_param_device();
+            return PTR_ERR(pdev);
+        }
+        lcd_param_pdev[i] = pdev;
+    }
+    return 0;
+}
+
+// Module init
+static int __init rpigpio_lcd_minit(void){
+    // initialize variables
+    dev_t devt;
+    int ret=0;
+	
+    printk(KERN_INFO "%s\n",SYSTIMER_MOD_DESCR);
+    printk(KERN_INFO "By: %s\n",SYSTIMER_MOD_AUTH);
+
+    // register a range of character devices, one minor per panel
+    ret=alloc_chrdev_region(&devt,0,LCD_MAX_DEVS,"gpio_lcd");
+    if (ret<0) {
+    	printk(KERN_NOTICE "Cannot register char device\n");
+        return ret;
+    }
+    lcd_mjr=MAJOR(devt);
+    // create class for LCD for module
+    lcd_class=class_create(THIS_MODULE, "lcd_class");
+    if (IS_ERR(lcd_class)) {
+    	unregister_chrdev_region(devt,LCD_MAX_DEVS);
+    	return PTR_ERR(lcd_class);
+    }
+    lcd_class->devnode=lcd_devnode;
+    lcd_debugfs=debugfs_create_dir("lcd", NULL);
+
+    ret=platform_driver_register(&lcd_driver);
+    if (ret) {
+        debugfs_remove_recursive(lcd_debugfs);
+        class_destroy(lcd_class);
+        unregister_chrdev_region(devt,LCD_MAX_DEVS);
+        return ret;
+    }
+    if (param_device) {
+        ret=lcd_add_param_device();
+        if (ret) {
+            platform_driver_unregister(&lcd_driver);
+            debugfs_remove_recursive(lcd_debugfs);
+            class_destroy(lcd_class);
+            unregister_chrdev_region(devt,LCD_MAX_DEVS);
+            return ret;
+        }
     }
-    lcd_init();	
-	
-    //initialize the spinlock
-    spin_lock_init(&(lcd.lock));	
 
     return ret;
 }
 
 // Module removal
 static void __exit rpigpio_lcd_mcleanup(void){
-    // clear the LCD and release all GPIO pins in use
-    lcd_write(clear);
-    gpio_free(4);
-    gpio_free(17);
-    gpio_free(18);
-    gpio_free(22);
-    gpio_free(23);
-    gpio_free(24);
-    gpio_free(25);
-    
-    // destroy platform device and other module resources
-    device_destroy(lcd.lcd_class,MKDEV(lcd.lcd_mjr,0));
-    class_destroy(lcd.lcd_class);
-    unregister_chrdev(lcd.lcd_mjr,"lcd_gpio");
+    // remove every panel, then the module resources
+    lcd_del_param_device();
+    platform_driver_unregister(&lcd_driver);
+    debugfs_remove_recursive(lcd_debugfs);
+    class_destroy(lcd_class);
+    unregister_chrdev_region(MKDEV(lcd_mjr,0),LCD_MAX_DEVS);
     printk(KERN_INFO "Goodbye\n");
     return;
 }
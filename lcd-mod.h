@@ -0,0 +1,137 @@
+#ifndef LCD_MOD_H
+#define LCD_MOD_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+Userspace interface of the GPIO LCD driver. Plain text goes through
+write(); the ioctls below are for programs that drive the LCD directly.
+
+mmap() at offset 0 with MAP_SHARED maps the driver's framebuffer: rows *
+cols bytes, one per character cell, row by row. Stores into it reach the
+LCD within the driver's refresh interval; use LCD_IOC_GET_GEOMETRY for
+the layout.
+*/
+
+/* One HD44780 instruction (rs = 0) or character (rs = 1). */
+struct lcd_op {
+    __u8 rs;
+    __u8 val;
+};
+
+/* Argument of LCD_IOC_BATCH: ops points to count struct lcd_op, which
+are queued for the LCD in order with one copy and one lock acquisition.
+Characters update the driver's framebuffer as well, so later write()s
+are diffed against them. When the queue is too full for the batch the
+call sleeps, or fails with EAGAIN on an O_NONBLOCK descriptor; poll()
+reports POLLOUT once a batch of LCD_BATCH_MAX ops would fit. write()
+never blocks.
+
+A batch flagged LCD_BATCH_URGENT goes on a priority lane of its own, of
+at most LCD_URGENT_MAX ops. A framebuffer flush in progress stops for it
+at the next byte and picks up where it left off afterwards. Queued
+batches are never split: the urgent batch goes in after the batch being
+sent, ahead of the rest, after which the entry mode and DDRAM address
+are put back as that batch left them (a batch that ended in CGRAM has to
+set its CGRAM address again). */
+struct lcd_batch {
+    __u64 ops;
+    __u32 count;
+    __u32 flags;    // LCD_BATCH_*
+};
+
+#define LCD_BATCH_MAX 1024
+#define LCD_URGENT_MAX 256
+
+#define LCD_BATCH_URGENT 0x1
+
+/* Result of LCD_IOC_GET_GEOMETRY */
+struct lcd_geometry {
+    __u32 rows;
+    __u32 cols;
+};
+
+#define LCD_IOC_MAGIC 'L'
+#define LCD_IOC_BATCH _IOW(LCD_IOC_MAGIC, 1, struct lcd_batch)
+#define LCD_IOC_GET_GEOMETRY _IOR(LCD_IOC_MAGIC, 2, struct lcd_geometry)
+
+/* Framebuffer flushes per second, __u32; 0 removes the limit. Changes
+made within one frame period are sent together in one flush. */
+#define LCD_IOC_SET_MAX_FPS _IOW(LCD_IOC_MAGIC, 3, __u32)
+#define LCD_IOC_GET_MAX_FPS _IOR(LCD_IOC_MAGIC, 4, __u32)
+
+/* Argument of LCD_IOC_SET_GLYPH: a custom 5x8 character, one byte per
+pixel row from the top, low five bits used, registered under id (below
+LCD_GLYPH_MAX). Registering an id again changes it wherever it is shown.
+The driver keeps the glyphs on screen in the LCD's eight CGRAM slots and
+only uploads one when it is not in a slot already; once glyphs are in use
+the driver owns CGRAM, and raw CGRAM writes make it upload them again. */
+struct lcd_glyph {
+    __u32 id;
+    __u8 rows[8];
+};
+
+#define LCD_GLYPH_MAX 64
+
+/* Argument of LCD_IOC_PUT_GLYPH: show glyph id at a framebuffer cell. The
+cell reads back as LCD_GLYPH_CELL through mmap() until something else is
+stored there. At most eight different glyphs can be on screen at once;
+cells of any more stay blank until a slot frees up. */
+struct lcd_glyph_pos {
+    __u32 id;
+    __u32 row;
+    __u32 col;
+};
+
+#define LCD_GLYPH_CELL 0x08
+
+#define LCD_IOC_SET_GLYPH _IOW(LCD_IOC_MAGIC, 5, struct lcd_glyph)
+#define LCD_IOC_PUT_GLYPH _IOW(LCD_IOC_MAGIC, 6, struct lcd_glyph_pos)
+
+/* Argument of LCD_IOC_MARQUEE: scroll text across a panel of one or two
+rows without sending it again. Each line of display RAM is loaded once
+with its 40 characters of text (a one-row panel scrolls all 80 as one
+line) and the LCD's own display shift then moves them a column to the
+left every period_ms, wrapping around. The framebuffer is not shown while
+the marquee runs; period_ms = 0 stops it and brings the framebuffer back. */
+struct lcd_marquee {
+    __u32 period_ms;
+    __u32 flags;    // must be 0
+    __u8 text[2][40];
+};
+
+#define LCD_IOC_MARQUEE _IOW(LCD_IOC_MAGIC, 7, struct lcd_marquee)
+
+/* Every panel has LCD_VC_MAX virtual consoles, each a framebuffer of its
+own with its own write() cursor. An open file writes to and maps console
+0 until LCD_IOC_SELECT_VC picks another, and LCD_IOC_SHOW_VC picks the
+console the panel shows (with the driver's vc_rotate_ms parameter set,
+the consoles that have files on them also take turns). A switch only
+sends the cells where the two consoles differ. Both take a __u32. */
+#define LCD_VC_MAX 4
+
+#define LCD_IOC_SELECT_VC _IOW(LCD_IOC_MAGIC, 8, __u32)
+#define LCD_IOC_SHOW_VC _IOW(LCD_IOC_MAGIC, 9, __u32)
+
+/* LCD_IOC_SYNC waits until every change made to the framebuffer before the
+call has been sent to the LCD, for timing how long updates take to show.
+While a marquee runs it waits for the marquee to stop. */
+#define LCD_IOC_SYNC _IO(LCD_IOC_MAGIC, 10)
+
+/* Result of LCD_IOC_GET_STATS: totals since the panel came up. Every
+update made through write() or the glyph and console ioctls asks for a
+flush; coalesced counts those that found one already pending, so frames
+can stay well below the number of updates made. Stores into a mapping
+are picked up by the periodic refresh and are not counted. frames only
+counts flushes that had something to send. */
+struct lcd_stats_info {
+    __u64 bytes;        // instructions and characters sent
+    __u64 frames;       // framebuffer flushes sent whole
+    __u64 coalesced;    // changes folded into a pending flush
+    __u64 skipped;      // unchanged cells flushes left alone
+};
+
+#define LCD_IOC_GET_STATS _IOR(LCD_IOC_MAGIC, 11, struct lcd_stats_info)
+
+#endif
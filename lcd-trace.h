@@ -0,0 +1,93 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lcd
+
+#if !defined(LCD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define LCD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Tracepoints on the transmit path of the GPIO LCD driver: ops going into
+and coming out of the command queues, every byte put on the bus, and
+every framebuffer flush. minor tells the panels apart. */
+
+TRACE_EVENT(lcd_enqueue,
+    TP_PROTO(int minor, unsigned int count, bool urgent),
+    TP_ARGS(minor, count, urgent),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, count)
+        __field(bool, urgent)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->urgent = urgent;
+    ),
+    TP_printk("lcd%d ops=%u%s", __entry->minor, __entry->count,
+              __entry->urgent ? " urgent" : "")
+);
+
+TRACE_EVENT(lcd_dequeue,
+    TP_PROTO(int minor, unsigned int count, bool urgent),
+    TP_ARGS(minor, count, urgent),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, count)
+        __field(bool, urgent)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->urgent = urgent;
+    ),
+    TP_printk("lcd%d ops=%u%s", __entry->minor, __entry->count,
+              __entry->urgent ? " urgent" : "")
+);
+
+// One instruction or character, sent to panels at once on shared lines
+TRACE_EVENT(lcd_xmit,
+    TP_PROTO(int minor, u8 val, int rs, unsigned int panels),
+    TP_ARGS(minor, val, rs, panels),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(u8, val)
+        __field(int, rs)
+        __field(unsigned int, panels)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->val = val;
+        __entry->rs = rs;
+        __entry->panels = panels;
+    ),
+    TP_printk("lcd%d %s 0x%02x panels=%u", __entry->minor,
+              __entry->rs ? "data" : "cmd", __entry->val, __entry->panels)
+);
+
+// A flush as planned: ops to send, cells changed and cells left alone
+TRACE_EVENT(lcd_flush,
+    TP_PROTO(int minor, unsigned int ops, unsigned int cells, unsigned int skipped),
+    TP_ARGS(minor, ops, cells, skipped),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, ops)
+        __field(unsigned int, cells)
+        __field(unsigned int, skipped)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->ops = ops;
+        __entry->cells = cells;
+        __entry->skipped = skipped;
+    ),
+    TP_printk("lcd%d ops=%u cells=%u skipped=%u", __entry->minor,
+              __entry->ops, __entry->cells, __entry->skipped)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lcd-trace
+#include <trace/define_trace.h>